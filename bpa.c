@@ -13,6 +13,11 @@
 #include <sys/wait.h>
 #include <ctype.h>
 #include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/resource.h>
 /* convenient debugging macros */
 #define dbgd(x) prt(#x ": %d\n", x),flush()
 #define dbgx(x) prt(#x ": %x\n", x),flush()
@@ -42,13 +47,16 @@ typedef struct {
 
 #define BUF_SZ (1 << 30)
 
-u8 *input_space; // remains immutable once stdin has been read up to EOF.
+u8 *input_space; // remains immutable once the input has been mapped or read up to EOF.
 u8 *output_space;
 u8 *cmp_space;
 span out, inp, cmp;
 /*
-The inp variable is the span which writes into input_space, and then is the immutable copy of stdin for the duration of the process.
+The inp variable is the span over input_space, which is the immutable input for the duration of the process.
 The number of bytes of input is len(inp).
+When the input is a regular file (named on the command line, or redirected to stdin) input_space is a read-only mapping of it, so we never copy it and there is no size limit other than the address space.
+Otherwise (a pipe, say) we read it in large chunks into a buffer that grows as needed.
+Either way there is at least one zero byte after inp.end, since the parser sometimes peeks one byte past the end of the span it is looking at.
 */
 
 int empty(span);
@@ -95,11 +103,7 @@ int span_cmp(span, span);
 span S(char*);
 span nullspan();
 
-/* our input statistics on raw bytes */
-
-int counts[256] = {0};
-
-void read_and_count_stdin(); // populate inp and counts[]
+void read_input(char *path); // populate inp from the named file, or from stdin if path is NULL
 int empty(span s) {
   return s.end == s.buf;
 }
@@ -110,14 +114,92 @@ u8 in(span s, u8* p) { return s.buf <= p && p < s.end; }
 
 int out_WRITTEN = 0, cmp_WRITTEN = 0;
 
+/* Arena
+
+Our spaces (output_space, cmp_space, the span arena, and the output space of each stockfish process) used to be malloc'd in full up front, a GiB each for the first two.
+With strict overcommit, or a container memory limit and many bpa processes per host, this fails or is charged as if we used it all, although one small game needs a few KiB.
+
+So each of them is now an Arena: we reserve the address space with mmap and PROT_NONE, which costs no memory and is not charged against the commit limit, and we commit it (make it readable and writable) in ARENA_CHUNK steps as the data reaches the end of what has been committed.
+The limit on each space is still its reserved size, but the memory used is only what has been written.
+Since the data in a space stays where it is, the spans pointing into it stay valid, which would not be the case if we grew it with realloc.
+
+Everything that writes into a space must call arena_commit first with the end of what it will write.
+For out this is out_commit, which the prt family of functions call.
+We never decommit, so the committed size of an arena is also its peak, which report_memory prints (see --memory-report).
+*/
+
+typedef struct {
+  u8 *base;
+  size_t reserved;  // bytes of address space
+  size_t committed; // bytes from base that are readable and writable
+  char *name;       // for report_memory
+} Arena;
+
+#define ARENA_CHUNK (64 << 10)
+#define MAX_ARENAS 256
+
+Arena *arenas[MAX_ARENAS]; // every arena, for report_memory
+int n_arenas;
+
+Arena output_arena, cmp_arena, span_arena_space;
+
+u8 *arena_reserve(Arena *a, size_t size, char *name) {
+  a->base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (a->base == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  a->reserved = size;
+  a->committed = 0;
+  a->name = name;
+  if (n_arenas < MAX_ARENAS) arenas[n_arenas++] = a;
+  return a->base;
+}
+
+void arena_commit(Arena *a, u8 *upto) {
+  size_t need = upto - a->base;
+  if (need <= a->committed) return;
+  if (need > a->reserved) {
+    fprintf(stderr, "Error: %s overflow (more than %zu bytes)\n", a->name, a->reserved);
+    exit(EXIT_FAILURE);
+  }
+  size_t new_committed = (need + ARENA_CHUNK - 1) / ARENA_CHUNK * ARENA_CHUNK;
+  if (new_committed > a->reserved) new_committed = a->reserved;
+  if (mprotect(a->base + a->committed, new_committed - a->committed, PROT_READ | PROT_WRITE) == -1) {
+    perror("mprotect");
+    exit(EXIT_FAILURE);
+  }
+  a->committed = new_committed;
+}
+
+void arena_release(Arena *a) {
+  munmap(a->base, a->reserved);
+  for (int i = 0; i < n_arenas; i++) if (arenas[i] == a) arenas[i] = arenas[--n_arenas];
+}
+
+/* out_commit makes room for n more bytes in out, whichever space it points to at the moment (see prt2cmp).
+
+When out is the output space, and would grow past OUTPUT_FLUSH_SZ, we first stream what it holds to stdout (see flush), so the output space never holds more than about that much however long the run is.
+Nothing keeps a span into the output space once it has been written, so the next bytes can go to the start of it again.
+*/
+
+#define OUTPUT_FLUSH_SZ (1 << 20)
+
+extern int saved_out_stack; // see redir
+
+void out_commit(size_t n) {
+  if (out.buf == output_arena.base) {
+    if (len(out) + n > OUTPUT_FLUSH_SZ && !saved_out_stack) flush();
+    arena_commit(&output_arena, out.end + n);
+  }
+  else if (out.buf == cmp_arena.base) arena_commit(&cmp_arena, out.end + n);
+}
+
 void init_spans() {
-  input_space = malloc(BUF_SZ);
-  output_space = malloc(BUF_SZ);
-  cmp_space = malloc(BUF_SZ);
+  output_space = arena_reserve(&output_arena, BUF_SZ, "output space");
+  cmp_space = arena_reserve(&cmp_arena, BUF_SZ, "cmp space");
   out.buf = output_space;
   out.end = output_space;
-  inp.buf = input_space;
-  inp.end = input_space + BUF_SZ;
   cmp.buf = cmp_space;
   cmp.end = cmp_space;
 }
@@ -167,18 +249,74 @@ span S(char *s) {
   return ret;
 }
 
-void read_and_count_stdin() {
-  int c;
-  while ((c = getchar()) != EOF) {
-    //if (c == ' ') continue;
-    assert(c != 0);
-    counts[c]++;
-    *inp.buf = c;
-    inp.buf++;
-    if (len(inp) == BUF_SZ) exit2(1);
+/*
+To map a file we first reserve its size plus one page of anonymous zero memory, then map the file over the start of that reservation.
+This gives us the zero byte after the end even when the file size is an exact multiple of the page size, where the bytes after the end of a plain file mapping would fault.
+*/
+
+int map_input(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) return 0;
+  size_t size = st.st_size;
+  if (size == 0) return 0; // nothing to map, read_input handles it as an empty buffer
+  size_t page = sysconf(_SC_PAGESIZE);
+  u8 *region = mmap(NULL, size + page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) return 0;
+  if (mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(region, size + page);
+    return 0;
+  }
+  madvise(region, size, MADV_SEQUENTIAL);
+  input_space = region;
+  inp.buf = input_space;
+  inp.end = input_space + size;
+  return 1;
+}
+
+/* The fallback for pipes and anything else we can't map: read() into a buffer that doubles as it fills, keeping one spare zero byte at the end. */
+
+#define INPUT_CHUNK (1 << 20)
+
+void read_input_stream(int fd) {
+  size_t cap = INPUT_CHUNK, n = 0;
+  input_space = malloc(cap + 1);
+  for (;;) {
+    if (n == cap) {
+      cap *= 2;
+      input_space = realloc(input_space, cap + 1);
+    }
+    if (!input_space) {
+      prt("Out of memory reading input\n");
+      exit2(1);
+    }
+    ssize_t r = read(fd, input_space + n, cap - n);
+    if (r == 0) break;
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      perror("read input");
+      exit2(1);
+    }
+    n += r;
   }
-  inp.end = inp.buf;
+  input_space[n] = 0;
   inp.buf = input_space;
+  inp.end = input_space + n;
+}
+
+size_t input_size; // len(inp) before we started parsing it
+
+void read_input(char *path) {
+  int fd = 0;
+  if (path) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      perror(path);
+      exit2(1);
+    }
+  }
+  if (!map_input(fd)) read_input_stream(fd);
+  if (path) close(fd); // the mapping stays valid after the close
+  input_size = len(inp);
 }
 
 span saved_out[16] = {0};
@@ -205,28 +343,30 @@ void prt2cmp() { /*if (out.buf == output_space)*/ swapcmp(); }
 void prt2std() { /*if (out.buf == cmp_space)*/ swapcmp(); }
 
 void prt(const char * fmt, ...) {
-  va_list ap;
+  va_list ap, ap2;
   va_start(ap, fmt);
+  va_copy(ap2, ap);
+  out_commit(vsnprintf(NULL, 0, fmt, ap2) + 1); // vsprintf also writes a terminating NUL
+  va_end(ap2);
   out.end += vsprintf((char*)out.end, fmt, ap);
-  if (out.buf + BUF_SZ < out.end) {
-    printf("OUTPUT OVERFLOW (%ld)\n", out.end - output_space);
-    exit2(7);
-  }
   va_end(ap);
   if (ALWAYS_FLUSH) flush();
 }
 
 void terpri() {
+  out_commit(1);
   *out.end = '\n';
   out.end++;
   if (ALWAYS_FLUSH) flush();
 }
 
 void w_char(char c) {
+  out_commit(1);
   *out.end++ = c;
 }
 
 void w_char_esc(char c) {
+  out_commit(5);
   if (c < 0x20 || c == 127) {
     out.end += sprintf((char*)out.end, "\\%03o", (u8)c);
   } else {
@@ -235,6 +375,7 @@ void w_char_esc(char c) {
 }
 
 void w_char_esc_pad(char c) {
+  out_commit(5);
   if (c < 0x20 || c == 127) {
     out.end += sprintf((char*)out.end, "\\%03o", (u8)c);
   } else {
@@ -244,6 +385,7 @@ void w_char_esc_pad(char c) {
 }
 
 void w_char_esc_dq(char c) {
+  out_commit(5);
   if (c < 0x20 || c == 127) {
     out.end += sprintf((char*)out.end, "\\%03o", (u8)c);
   } else if (c == '"') {
@@ -258,6 +400,7 @@ void w_char_esc_dq(char c) {
 }
 
 void w_char_esc_sq(char c) {
+  out_commit(5);
   if (c < 0x20 || c == 127) {
     out.end += sprintf((char*)out.end, "\\%03o", (u8)c);
   } else if (c == '\'') {
@@ -279,23 +422,51 @@ void wrs_esc(span s) {
   for (u8 *c = s.buf; c < s.end; c++) w_char_esc(*c);
 }
 
-// flush() is used to send our out buffer (written to by prt) to stdout. 
-void flush() {
-  if (out_WRITTEN < len(out)) {
-    printf("%.*s", len(out) - out_WRITTEN, out.buf + out_WRITTEN);
-    out_WRITTEN = len(out);
-    fflush(stdout);
+/*
+flush() is used to send our out buffer (written to by prt) to stdout.
+
+It used to printf everything from out_WRITTEN and leave out as it was, so the output space held the whole output of the run, and with many games that is most of the memory we use.
+Now it writes the pending bytes with write(), looping over partial writes, and then, if out is the output space, starts it over from the beginning.
+The output of a game is flushed when the game is complete (produce_output_2), and out_commit flushes early if a single game's output is very large, so the output space stays small and the output streams out one game at a time.
+Anything printed directly with printf goes out first, since it was printed first.
+
+flush_err() does the same for stderr.
+*/
+
+void write_all(int fd, u8 *buf, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, buf, n);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      perror("write");
+      exit(EXIT_FAILURE); // not exit2, which would flush again
+    }
+    buf += w;
+    n -= w;
   }
 }
 
-void flush_err() {
+void flush_fd(int fd) {
   if (out_WRITTEN < len(out)) {
-    fprintf(stderr, "%.*s", len(out) - out_WRITTEN, out.buf + out_WRITTEN);
+    write_all(fd, out.buf + out_WRITTEN, len(out) - out_WRITTEN);
     out_WRITTEN = len(out);
-    fflush(stderr);
+  }
+  if (out.buf == output_space && !saved_out_stack) {
+    out.end = out.buf;
+    out_WRITTEN = 0;
   }
 }
 
+void flush() {
+  fflush(stdout);
+  flush_fd(1);
+}
+
+void flush_err() {
+  fflush(stderr);
+  flush_fd(2);
+}
+
 void flush_to(char *fname) {
   int fd = open(fname, O_CREAT | O_WRONLY | O_TRUNC, 0666);
   dprintf(fd, "%*s", len(out) - out_WRITTEN, out.buf + out_WRITTEN);
@@ -395,9 +566,8 @@ span next_line(span *input) {
   if (empty(*input)) return nullspan();
   span line;
   line.buf = input->buf;
-  while (input->buf < input->end && *input->buf != '\n') {
-    input->buf++;
-  }
+  u8 *nl = memchr(input->buf, '\n', len(*input)); // much faster than a loop over the bytes, and stockfish's lines are long
+  input->buf = nl ? nl : input->end;
   line.end = input->buf;
   if (input->buf < input->end) { // If '\n' found, move past it for next call
     input->buf++;
@@ -434,13 +604,13 @@ int span_arena_stack[SPAN_ARENA_STACK];
 int span_arena_stack_n;
 
 void span_arena_alloc(int sz) {
-  span_arena = malloc(sz * sizeof *span_arena);
+  span_arena = (span*)arena_reserve(&span_arena_space, sz * sizeof *span_arena, "span arena");
   span_arenasz = sz;
   span_arena_used = 0;
   span_arena_stack_n = 0;
 }
 void span_arena_free() {
-  free(span_arena);
+  arena_release(&span_arena_space);
 }
 void span_arena_push() {
   assert(span_arena_stack_n < SPAN_ARENA_STACK);
@@ -459,7 +629,12 @@ spans spans_alloc(int n) {
   ret.s = span_arena + span_arena_used;
   ret.n = n;
   span_arena_used += n;
-  assert(span_arena_used < span_arenasz);
+  if (span_arena_used >= span_arenasz) {
+    prt("Error: out of span arena space (%d spans); with --batch, try fewer games at a time.\n", span_arenasz);
+    flush();
+    exit(EXIT_FAILURE);
+  }
+  arena_commit(&span_arena_space, (u8*)(span_arena + span_arena_used));
   return ret;
 }
 
@@ -523,22 +698,92 @@ int is_one_of(span x, spans ys) {
 
 This typedef struct contains everything we need and pass around for talking to the stockfish process.
 
-This includes a pid, an int[2] for the sending pipe and receiving pipe, called to_stockfish and from_stockfish resp. and a u8* cmp_highwater, which we use to know how much data is new in cmp after we pipe some stockfish output into there.
+This includes a pid, an int[2] for the sending pipe and receiving pipe, called to_stockfish and from_stockfish resp., the span output that we pipe the stockfish output into, and a u8* highwater, which we use to know how much data is new in output after we pipe some stockfish output into there (since the output space is emptied when we set the highwater mark, this is now always the start of the output).
+
+Originally all stockfish output went into cmp, but since we can run several stockfish processes at once (see do_analysis_pool) and read from them in whatever order their output arrives, each process now has its own output space so their lines can't interleave.
 */
 
 typedef struct {
   pid_t pid;     // Process ID of the Stockfish process
   int to_stockfish[2]; // Pipe for sending data to Stockfish
   int from_stockfish[2]; // Pipe for receiving data from Stockfish
-  u8* cmp_highwater; // Highwater mark of consumed output from Stockfish in cmp
+  span output; // Everything this Stockfish has printed so far, in its own space
+  u8* highwater; // Highwater mark of consumed output from Stockfish in output
+  u8* scanned; // How far past highwater we have already searched for a target string
+  Arena output_space; // where output lives
+  int multipv; // the MultiPV we last set on this process (see set_search_multipv)
 } StockfishProcess;
 
 /*
+now_ms gives a monotonic clock in milliseconds, which we use for deadlines when waiting on stockfish.
+*/
+
+long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+now_us is the same clock in microseconds, which we use to time the phases of a run: parsing the PGN, turning SAN into LAN, the analysis, and producing the output.
+main adds the time since the end of the previous phase to phase_us with phase_end after each of them, which costs next to nothing, so we always do it.
+The analysis is mostly waiting for stockfish, so we also add up the time we spend blocked in poll() or sleeping while stockfish searches (engine_wait_us), and the bytes we read from it (engine_bytes_read).
+What is left of the analysis time after the waits is our own work on the engine output.
+--bench prints all of this at the end (see bench_report).
+
+There are also some counters of the work we do: the commands we send to stockfish, the info lines we parse (and the time parse_stockfish_output_2 and, with --adaptive, adaptive_read take), the searches (one per position analyzed, or two with --two-tier, --game-budget, --quick, or --triage), the positions analyzed (depth_plies, see do_analysis), and the greatest depth any search reached.
+--stats writes all of the timings and counters as JSON at the end (see write_stats).
+*/
+
+long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+enum { PHASE_PARSE, PHASE_LAN_MOVES, PHASE_ANALYSIS, PHASE_OUTPUT, N_PHASES };
+char *phase_names[N_PHASES] = { "parse", "lan_moves", "analysis", "output" };
+long long phase_us[N_PHASES], phase_mark_us;
+long long engine_wait_us;
+long long engine_bytes_read;
+long long engine_parse_us;
+long long engine_commands, info_lines_parsed, searches;
+int max_depth_reached;
+
+#define PROGRESS_INTERVAL_MS 1000
+long long plies_analyzed, engine_search_ms; // for --progress
+int progress;
+void progress_tick();
+
+void phase_end(int phase) {
+  long long now = now_us();
+  phase_us[phase] += now - phase_mark_us;
+  phase_mark_us = now;
+}
+
+/*
+In launch_stockfish we allocate the output space, create the pipes, and fork and exec stockfish with its stdin and stdout connected to the pipes.
+
+The output space only ever holds the output of one command (see set_stockfish_highwater), so ENGINE_OUTPUT_SZ is a limit on how much stockfish can print in one search, which is far more than it does even with MultiPV 500 and a long movetime.
+It is an Arena, so pages we never touch cost nothing, and the reservation isn't charged against the commit limit.
+(Otherwise, with several processes, each fork has to account for all of the previous processes' spaces as well as our own, and fails with ENOMEM long before any memory is actually used.)
+
+The command we run is engine_argv, which is just "stockfish" (found in the PATH) unless --engine names another UCI engine, or --bench runs our own mock engine instead (see mock_engine).
 */
 
+#define ENGINE_OUTPUT_SZ (64 << 20)
+
+char *engine_argv[16] = { "stockfish", NULL };
+
 void launch_stockfish(StockfishProcess *sp) {
-  // Create pipes
-  if (pipe(sp->to_stockfish) == -1 || pipe(sp->from_stockfish) == -1) {
+  // Allocate the space for this process's output
+  sp->output.buf = arena_reserve(&sp->output_space, ENGINE_OUTPUT_SZ, "stockfish output");
+  sp->output.end = sp->output.buf;
+  sp->highwater = sp->output.buf;
+  sp->scanned = sp->output.buf;
+
+  // Create pipes; they are close-on-exec so that stockfish processes we start later don't inherit this one's pipes (dup2 clears the flag on the child's stdin and stdout)
+  if (pipe2(sp->to_stockfish, O_CLOEXEC) == -1 || pipe2(sp->from_stockfish, O_CLOEXEC) == -1) {
     perror("pipe");
     exit2(EXIT_FAILURE);
   }
@@ -560,9 +805,9 @@ void launch_stockfish(StockfishProcess *sp) {
     close(sp->from_stockfish[0]);
     close(sp->from_stockfish[1]);
 
-    // Execute Stockfish
-    execlp("stockfish", "stockfish", (char *)NULL);
-    perror("execlp");
+    // Execute Stockfish (or whatever engine_argv says, see --engine and --bench)
+    execvp(engine_argv[0], engine_argv);
+    perror(engine_argv[0]);
     exit2(EXIT_FAILURE);
   } else {
     // Parent process: Close unused ends of the pipes
@@ -575,45 +820,585 @@ void launch_stockfish(StockfishProcess *sp) {
 
 void send_to_stockfish(StockfishProcess *sp, const char *cmd) {
   if (PRT_STOCKFISH) prt("sending to stockfish: %s", cmd);
+  for (const char *c = cmd; *c; c++) engine_commands += *c == '\n'; // one command per line, which may be sent in pieces
   write(sp->to_stockfish[1], cmd, strlen(cmd));
 }
 
 /*
-We read output from stockfish and append it to cmp.
+We read output from stockfish and append it to sp->output (this used to be cmp).
 
-We use a 1k buffer but read again if the buffer was filled by the read() call.
-We memcpy to cmp.end so that we append, and then extend cmp.end such that len(cmp) will be greater by the amount of data read.
+wait_for_stockfish blocks in poll() until stockfish has output for us or the timeout (in ms) expires, and returns 1 or 0 respectively.
+
+read_from_stockfish reads whatever output is available right now, directly into the end of the output space, and never blocks: after each read we ask poll() with a zero timeout whether there is more.
+(It used to read through a 1k buffer with blocking reads, repeating while the buffer was filled, which could block forever if the output happened to be an exact multiple of the buffer size.)
+We return the number of bytes read, which is zero if there was nothing to read.
+If stockfish has closed its end of the pipe we report this and exit, since we can't continue without it.
 */
 
-void read_from_stockfish(StockfishProcess *sp) {
-  char buffer[1024];
-  ssize_t bytes_read;
-  do {
-    bytes_read = read(sp->from_stockfish[0], buffer, sizeof(buffer) - 1);
-    if (bytes_read > 0) {
-      buffer[bytes_read] = '\0'; // Null-terminate the string
-      // Append the read data to cmp
-      memcpy(cmp.end, buffer, bytes_read);
-      cmp.end += bytes_read; // Update cmp.end to reflect the new data
+int wait_for_stockfish(StockfishProcess *sp, int timeout_ms) {
+  struct pollfd pfd = { sp->from_stockfish[0], POLLIN, 0 };
+  long long start = timeout_ms > 0 ? now_us() : 0;
+  if (progress && timeout_ms > PROGRESS_INTERVAL_MS) timeout_ms = PROGRESS_INTERVAL_MS; // our callers wait again until their deadline
+  int ready = poll(&pfd, 1, timeout_ms < 0 ? 0 : timeout_ms);
+  if (timeout_ms > 0) engine_wait_us += now_us() - start;
+  if (timeout_ms > 0) progress_tick();
+  if (ready < 0) {
+    perror("poll");
+    exit2(EXIT_FAILURE);
+  }
+  return ready;
+}
+
+int read_from_stockfish(StockfishProcess *sp) {
+  int total = 0;
+  while (wait_for_stockfish(sp, 0)) {
+    size_t room = ENGINE_OUTPUT_SZ - len(sp->output);
+    if (!room) {
+      prt("Error: stockfish printed more than %d bytes in answer to one command.\n", ENGINE_OUTPUT_SZ); flush();
+      exit(EXIT_FAILURE);
+    }
+    size_t chunk = room < 65536 ? room : 65536;
+    arena_commit(&sp->output_space, sp->output.end + chunk);
+    ssize_t bytes_read = read(sp->from_stockfish[0], sp->output.end, chunk);
+    if (bytes_read == 0) {
+      prt("Error: stockfish exited unexpectedly.\n"); flush();
+      exit(EXIT_FAILURE);
     }
-  } while (bytes_read == sizeof(buffer) - 1); // Continue reading if buffer was filled
+    if (bytes_read < 0) {
+      perror("read");
+      exit2(EXIT_FAILURE);
+    }
+    sp->output.end += bytes_read; // Update output.end to reflect the new data
+    total += bytes_read;
+    engine_bytes_read += bytes_read;
+  }
   if (PRT_STOCKFISH) {
     prt("read_from_stockfish:\n");
-    wrs(cmp);terpri();
+    wrs(sp->output);terpri();
   }
+  return total;
 }
 
 /*
-We use cmp_highwater to determine how much of the output in cmp from the stockfish process is new after we send some particular command to stockfish.
+We use highwater to determine how much of the output from the stockfish process is new after we send some particular command to stockfish.
 We manually indicate the highwater mark by calling set_stockfish_highwater and then use get_stockfish_new_output to get a span of the output past this point.
+
+Nothing before the highwater mark is ever looked at again, so we don't keep it: setting the highwater mark empties the output space, and the output of the next command starts at the beginning again.
+This keeps the memory for each stockfish process down to the output of one search, however many positions we analyze.
+It does mean that a span into the output is only good until the next set_stockfish_highwater, so anything we keep from it must be copied (the evals use the LAN spans from move_lan for this reason).
 */
 
 void set_stockfish_highwater(StockfishProcess *sp) {
-  sp->cmp_highwater = cmp.end;
+  sp->output.end = sp->output.buf;
+  sp->highwater = sp->output.buf;
+  sp->scanned = sp->output.buf;
 }
 
 span get_stockfish_new_output(StockfishProcess *sp) {
-  return (span){sp->cmp_highwater, cmp.end};
+  return (span){sp->highwater, sp->output.end};
+}
+
+/*
+stockfish_new_output_contains tells whether the output since the highwater mark contains the target, like contains(get_stockfish_new_output(sp), target), but only looks at bytes that arrived since the last time we asked.
+We remember in sp->scanned how far we have looked, and back up by one less than the length of the target so that a match split across two reads is still found.
+This keeps waiting for a target linear in the size of the output, rather than rescanning everything since the highwater mark each time more arrives.
+*/
+
+int stockfish_new_output_contains(StockfishProcess *sp, span target) {
+  u8 *start = sp->scanned - (len(target) - 1);
+  if (start < sp->highwater) start = sp->highwater;
+  sp->scanned = sp->output.end;
+  return contains((span){start, sp->output.end}, target);
+}
+
+/* Board
+
+We keep our own representation of the chess position, so that we can turn SAN into LAN, list the legal moves in a position, and produce FEN strings without asking stockfish.
+Asking stockfish costs a pipe round-trip (and usually a sleep) per question, and we used to ask three questions per ply before the analysis even started.
+
+Squares are numbered 0 to 63 from a1 to h8, i.e. square = rank * 8 + file, with both counted from zero.
+The pieces are stored twice: as FEN chars (PNBRQK for white, pnbrqk for black, 0 for an empty square) in squares[], which is what we use when we need to know what is on a given square, and as bitboards by color and piece type, which is what the move generator uses.
+The rest of the struct is the other FEN fields.
+*/
+
+typedef unsigned short u16;
+typedef unsigned long long u64;
+
+enum { WHITE, BLACK };
+enum { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING };
+
+typedef struct {
+  char squares[64];    // FEN char of the piece on each square, 0 if empty
+  u64 pieces[2][6];    // bitboards by color and piece type
+  u64 occupied[2];     // bitboards of all pieces of each color
+  int side_to_move;    // WHITE or BLACK
+  int castling;        // castling rights: 1 = K, 2 = Q, 4 = k, 8 = q
+  int ep_square;       // en passant target square, or -1
+  int halfmove_clock;  // plies since the last capture or pawn move
+  int fullmove_number; // starts at 1 and is incremented after black moves
+} Board;
+
+/*
+A Move is 16 bits: the from square in bits 0-5, the to square in bits 6-11, and the promotion piece type in bits 12-14 (0 for none, otherwise KNIGHT to QUEEN).
+Castling is a king move of two squares and en passant is a pawn capture onto the ep square, exactly as in the LAN that stockfish uses, so we need no other flags.
+No legal move has the same from and to square, so we use 0 to mean "no move".
+Every Move is less than MOVE_CODES, so a Move can index a table directly, which is how we find a move among the legal moves or the evals in constant time (see parse_stockfish_output_2 and adaptive_read).
+*/
+
+typedef u16 Move;
+
+#define MOVE_FROM(m) ((m) & 63)
+#define MOVE_TO(m) (((m) >> 6) & 63)
+#define MOVE_PROMO(m) ((m) >> 12)
+#define MAKE_MOVE(from, to, promo) ((Move)((from) | ((to) << 6) | ((promo) << 12)))
+#define MAX_MOVES 256 // more than the maximum number of legal moves in any position
+#define MOVE_CODES (1 << 15)
+
+#define STARTPOS_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+static const char piece_chars[2][7] = { "PNBRQK", "pnbrqk" };
+
+int piece_color(char c) { return isupper(c) ? WHITE : BLACK; }
+int piece_type(char c) { return strchr(piece_chars[WHITE], toupper(c)) - piece_chars[WHITE]; }
+u64 bit(int sq) { return 1ULL << sq; }
+int lsb(u64 b) { return __builtin_ctzll(b); }
+
+/*
+board_put and board_remove keep squares[] and the bitboards in sync.
+board_put requires the square to be empty; board_remove accepts an empty square and does nothing.
+*/
+
+void board_put(Board *b, int sq, char c) {
+  b->squares[sq] = c;
+  b->pieces[piece_color(c)][piece_type(c)] |= bit(sq);
+  b->occupied[piece_color(c)] |= bit(sq);
+}
+
+void board_remove(Board *b, int sq) {
+  char c = b->squares[sq];
+  if (!c) return;
+  b->squares[sq] = 0;
+  b->pieces[piece_color(c)][piece_type(c)] &= ~bit(sq);
+  b->occupied[piece_color(c)] &= ~bit(sq);
+}
+
+/*
+Attack tables for the pieces that don't slide, filled in once on first use.
+pawn_attacks[c][sq] is the set of squares attacked by a pawn of color c standing on sq.
+Sliding pieces are handled by walking rays in slider_attacks, which is slower than magic bitboards but plenty fast for our needs, since we look at a handful of positions per ply rather than millions.
+*/
+
+u64 knight_attacks[64], king_attacks[64], pawn_attacks[2][64];
+
+static const int knight_deltas[8][2] = {{1,2},{2,1},{2,-1},{1,-2},{-1,-2},{-2,-1},{-2,1},{-1,2}};
+static const int king_deltas[8][2] = {{1,0},{1,1},{0,1},{-1,1},{-1,0},{-1,-1},{0,-1},{1,-1}};
+static const int bishop_dirs[4][2] = {{1,1},{1,-1},{-1,1},{-1,-1}};
+static const int rook_dirs[4][2] = {{1,0},{-1,0},{0,1},{0,-1}};
+
+u64 offset_targets(int sq, const int (*deltas)[2], int n) {
+  u64 ret = 0;
+  for (int i = 0; i < n; i++) {
+    int f = sq % 8 + deltas[i][0], r = sq / 8 + deltas[i][1];
+    if (0 <= f && f < 8 && 0 <= r && r < 8) ret |= bit(r * 8 + f);
+  }
+  return ret;
+}
+
+void init_attack_tables() {
+  static int done = 0;
+  if (done) return;
+  static const int white_pawn[2][2] = {{-1,1},{1,1}}, black_pawn[2][2] = {{-1,-1},{1,-1}};
+  for (int sq = 0; sq < 64; sq++) {
+    knight_attacks[sq] = offset_targets(sq, knight_deltas, 8);
+    king_attacks[sq] = offset_targets(sq, king_deltas, 8);
+    pawn_attacks[WHITE][sq] = offset_targets(sq, white_pawn, 2);
+    pawn_attacks[BLACK][sq] = offset_targets(sq, black_pawn, 2);
+  }
+  done = 1;
+}
+
+u64 slider_attacks(int sq, u64 occ, const int (*dirs)[2]) {
+  u64 ret = 0;
+  for (int i = 0; i < 4; i++) {
+    int f = sq % 8, r = sq / 8;
+    for (;;) {
+      f += dirs[i][0]; r += dirs[i][1];
+      if (f < 0 || f > 7 || r < 0 || r > 7) break;
+      ret |= bit(r * 8 + f);
+      if (occ & bit(r * 8 + f)) break; // blocked; the blocker itself is attacked
+    }
+  }
+  return ret;
+}
+
+/*
+square_attacked tells whether any piece of color "by" attacks the square.
+For pawns we use the trick that a pawn of color "by" attacks sq exactly when a pawn of the other color on sq would attack the pawn's square.
+in_check is then just whether the king of the given color stands on an attacked square.
+*/
+
+int square_attacked(Board *b, int sq, int by) {
+  u64 occ = b->occupied[WHITE] | b->occupied[BLACK];
+  u64 *p = b->pieces[by];
+  if (pawn_attacks[!by][sq] & p[PAWN]) return 1;
+  if (knight_attacks[sq] & p[KNIGHT]) return 1;
+  if (king_attacks[sq] & p[KING]) return 1;
+  if (slider_attacks(sq, occ, bishop_dirs) & (p[BISHOP] | p[QUEEN])) return 1;
+  if (slider_attacks(sq, occ, rook_dirs) & (p[ROOK] | p[QUEEN])) return 1;
+  return 0;
+}
+
+int in_check(Board *b, int color) {
+  if (!b->pieces[color][KING]) return 0;
+  return square_attacked(b, lsb(b->pieces[color][KING]), !color);
+}
+
+/*
+gen_pseudo_moves writes every move that follows the movement rules into the array provided (which must have room for MAX_MOVES) and returns the count.
+These moves may leave our own king in check; gen_legal_moves filters those out.
+Castling is the exception: we already check here that the king is not in check and does not pass over an attacked square, since that cannot be seen from the position after the move.
+*/
+
+int gen_pseudo_moves(Board *b, Move *list) {
+  init_attack_tables();
+  int n = 0, us = b->side_to_move, them = !us;
+  u64 occ = b->occupied[WHITE] | b->occupied[BLACK];
+  u64 targets = ~b->occupied[us];
+  int dir = us == WHITE ? 8 : -8;
+  int start_rank = us == WHITE ? 1 : 6, last_rank = us == WHITE ? 7 : 0;
+
+  for (u64 bb = b->pieces[us][PAWN]; bb; bb &= bb - 1) {
+    int from = lsb(bb);
+    u64 to_set = pawn_attacks[us][from] & b->occupied[them];
+    if (b->ep_square >= 0) to_set |= pawn_attacks[us][from] & bit(b->ep_square);
+    int to = from + dir;
+    if (!(occ & bit(to))) {
+      to_set |= bit(to);
+      if (from / 8 == start_rank && !(occ & bit(to + dir))) to_set |= bit(to + dir);
+    }
+    for (; to_set; to_set &= to_set - 1) {
+      to = lsb(to_set);
+      if (to / 8 == last_rank) {
+        for (int promo = KNIGHT; promo <= QUEEN; promo++) list[n++] = MAKE_MOVE(from, to, promo);
+      } else {
+        list[n++] = MAKE_MOVE(from, to, 0);
+      }
+    }
+  }
+
+  for (int type = KNIGHT; type <= KING; type++) {
+    for (u64 bb = b->pieces[us][type]; bb; bb &= bb - 1) {
+      int from = lsb(bb);
+      u64 to_set;
+      switch (type) {
+        case KNIGHT: to_set = knight_attacks[from]; break;
+        case BISHOP: to_set = slider_attacks(from, occ, bishop_dirs); break;
+        case ROOK: to_set = slider_attacks(from, occ, rook_dirs); break;
+        case QUEEN: to_set = slider_attacks(from, occ, bishop_dirs) | slider_attacks(from, occ, rook_dirs); break;
+        default: to_set = king_attacks[from]; break;
+      }
+      for (to_set &= targets; to_set; to_set &= to_set - 1) list[n++] = MAKE_MOVE(from, lsb(to_set), 0);
+    }
+  }
+
+  // Castling: rights are cleared in make_move whenever the king or rook leaves (or is captured on) its square.
+  int home = us == WHITE ? 4 : 60;
+  int k_right = us == WHITE ? 1 : 4, q_right = us == WHITE ? 2 : 8;
+  if ((b->castling & (k_right | q_right)) && !square_attacked(b, home, them)) {
+    if ((b->castling & k_right) && !(occ & (bit(home + 1) | bit(home + 2)))
+        && !square_attacked(b, home + 1, them) && !square_attacked(b, home + 2, them)) {
+      list[n++] = MAKE_MOVE(home, home + 2, 0);
+    }
+    if ((b->castling & q_right) && !(occ & (bit(home - 1) | bit(home - 2) | bit(home - 3)))
+        && !square_attacked(b, home - 1, them) && !square_attacked(b, home - 2, them)) {
+      list[n++] = MAKE_MOVE(home, home - 2, 0);
+    }
+  }
+
+  assert(n <= MAX_MOVES);
+  return n;
+}
+
+/*
+make_move applies a move to the board, which we assume is at least pseudo-legal (i.e. came from gen_pseudo_moves or was checked against gen_legal_moves).
+Besides moving the piece we handle captures, en passant, promotion, the rook half of castling, and update the castling rights, ep square, and the two move counters.
+*/
+
+void make_move(Board *b, Move m) {
+  int from = MOVE_FROM(m), to = MOVE_TO(m), promo = MOVE_PROMO(m);
+  char c = b->squares[from];
+  int us = piece_color(c), type = piece_type(c);
+  int dir = us == WHITE ? 8 : -8;
+
+  if (type == PAWN || b->squares[to]) b->halfmove_clock = 0;
+  else b->halfmove_clock++;
+
+  if (type == PAWN && to == b->ep_square) board_remove(b, to - dir); // en passant capture
+  board_remove(b, to);
+  board_remove(b, from);
+  board_put(b, to, promo ? piece_chars[us][promo] : c);
+
+  if (type == KING && to == from + 2) { board_remove(b, from + 3); board_put(b, from + 1, piece_chars[us][ROOK]); }
+  if (type == KING && to == from - 2) { board_remove(b, from - 4); board_put(b, from - 1, piece_chars[us][ROOK]); }
+
+  b->ep_square = (type == PAWN && (to - from == 16 || from - to == 16)) ? from + dir : -1;
+
+  // Any move from or to a king or rook home square clears the corresponding rights.
+  static const struct { int sq, rights; } homes[] = {{4, 3}, {7, 1}, {0, 2}, {60, 12}, {63, 4}, {56, 8}};
+  for (int i = 0; i < 6; i++) {
+    if (from == homes[i].sq || to == homes[i].sq) b->castling &= ~homes[i].rights;
+  }
+
+  if (us == BLACK) b->fullmove_number++;
+  b->side_to_move = !us;
+}
+
+/*
+gen_legal_moves keeps each pseudo-legal move after which our own king is not in check.
+We simply make each move on a copy of the board, which is cheap since the Board is a small flat struct.
+*/
+
+int gen_legal_moves(Board *b, Move *list) {
+  Move pseudo[MAX_MOVES];
+  int n_pseudo = gen_pseudo_moves(b, pseudo), n = 0;
+  for (int i = 0; i < n_pseudo; i++) {
+    Board copy = *b;
+    make_move(&copy, pseudo[i]);
+    if (!in_check(&copy, b->side_to_move)) list[n++] = pseudo[i];
+  }
+  return n;
+}
+
+void skip_whitespace(span*);
+
+/*
+board_from_fen parses the six FEN fields from a span into the board.
+The two move counters may be missing, as they sometimes are in the wild.
+We return 1 on success and 0 if the FEN is malformed, in which case the board contents are unspecified.
+*/
+
+int board_from_fen(Board *b, span fen) {
+  memset(b, 0, sizeof *b);
+  b->ep_square = -1;
+  b->fullmove_number = 1;
+  int rank = 7, file = 0;
+  for (; !empty(fen) && *fen.buf != ' '; fen.buf++) {
+    char c = *fen.buf;
+    if (c == '/') {
+      if (file != 8 || rank == 0) return 0;
+      rank--; file = 0;
+    } else if ('1' <= c && c <= '8') {
+      file += c - '0';
+      if (file > 8) return 0;
+    } else if (strchr("PNBRQKpnbrqk", c) && file < 8) {
+      board_put(b, rank * 8 + file++, c);
+    } else {
+      return 0;
+    }
+  }
+  if (rank != 0 || file != 8) return 0;
+  skip_whitespace(&fen);
+  if (empty(fen) || (*fen.buf != 'w' && *fen.buf != 'b')) return 0;
+  b->side_to_move = *fen.buf++ == 'w' ? WHITE : BLACK;
+  skip_whitespace(&fen);
+  for (; !empty(fen) && *fen.buf != ' '; fen.buf++) {
+    switch (*fen.buf) {
+      case 'K': b->castling |= 1; break;
+      case 'Q': b->castling |= 2; break;
+      case 'k': b->castling |= 4; break;
+      case 'q': b->castling |= 8; break;
+      case '-': break;
+      default: return 0;
+    }
+  }
+  skip_whitespace(&fen);
+  if (len(fen) >= 2 && 'a' <= fen.buf[0] && fen.buf[0] <= 'h' && '1' <= fen.buf[1] && fen.buf[1] <= '8') {
+    b->ep_square = (fen.buf[1] - '1') * 8 + fen.buf[0] - 'a';
+    fen.buf += 2;
+  } else if (!consume_prefix(&fen, S("-"))) {
+    return 0;
+  }
+  skip_whitespace(&fen);
+  if (!empty(fen)) {
+    b->halfmove_clock = atoi((char*)fen.buf);
+    while (!empty(fen) && *fen.buf != ' ') fen.buf++;
+    skip_whitespace(&fen);
+    if (!empty(fen)) b->fullmove_number = atoi((char*)fen.buf);
+  }
+  return 1;
+}
+
+void board_startpos(Board *b) {
+  int ok = board_from_fen(b, S(STARTPOS_FEN));
+  assert(ok);
+}
+
+/*
+board_to_fen writes the FEN of the board into the buffer provided, which is null-terminated, like the buffers we used to fill from stockfish's "d" output.
+*/
+
+void board_to_fen(Board *b, char *fen, size_t fen_size) {
+  char tmp[128], *p = tmp;
+  for (int rank = 7; rank >= 0; rank--) {
+    int blanks = 0;
+    for (int file = 0; file < 8; file++) {
+      char c = b->squares[rank * 8 + file];
+      if (!c) { blanks++; continue; }
+      if (blanks) *p++ = '0' + blanks;
+      blanks = 0;
+      *p++ = c;
+    }
+    if (blanks) *p++ = '0' + blanks;
+    if (rank) *p++ = '/';
+  }
+  *p++ = ' ';
+  *p++ = b->side_to_move == WHITE ? 'w' : 'b';
+  *p++ = ' ';
+  if (!b->castling) *p++ = '-';
+  for (int i = 0; i < 4; i++) if (b->castling & (1 << i)) *p++ = "KQkq"[i];
+  *p++ = ' ';
+  if (b->ep_square < 0) *p++ = '-';
+  else { *p++ = 'a' + b->ep_square % 8; *p++ = '1' + b->ep_square / 8; }
+  snprintf(p, tmp + sizeof tmp - p, " %d %d", b->halfmove_clock, b->fullmove_number);
+  if (strlen(tmp) >= fen_size) {
+    prt("Error: FEN buffer too small.\n"); flush();
+    exit(EXIT_FAILURE);
+  }
+  strcpy(fen, tmp);
+}
+
+/*
+Conversions between Move and LAN.
+
+move_lan returns the LAN of a move as a span into a static table, which has a slot for every possible Move value, so the spans stay valid for the life of the process and can be compared with span_eq like any other LAN span.
+move_from_lan parses a LAN span of 4 or 5 chars back into a Move, returning 0 if it isn't one.
+*/
+
+span move_lan(Move m) {
+  static u8 lan_table[MOVE_CODES][5];
+  u8 *s = lan_table[m];
+  s[0] = 'a' + MOVE_FROM(m) % 8;
+  s[1] = '1' + MOVE_FROM(m) / 8;
+  s[2] = 'a' + MOVE_TO(m) % 8;
+  s[3] = '1' + MOVE_TO(m) / 8;
+  if (MOVE_PROMO(m)) s[4] = piece_chars[BLACK][MOVE_PROMO(m)];
+  return (span){s, s + (MOVE_PROMO(m) ? 5 : 4)};
+}
+
+int parse_square(u8 *s) {
+  if (s[0] < 'a' || s[0] > 'h' || s[1] < '1' || s[1] > '8') return -1;
+  return (s[1] - '1') * 8 + s[0] - 'a';
+}
+
+Move move_from_lan(span lan) {
+  if (len(lan) != 4 && len(lan) != 5) return 0;
+  int from = parse_square(lan.buf), to = parse_square(lan.buf + 2), promo = 0;
+  if (from < 0 || to < 0) return 0;
+  if (len(lan) == 5) {
+    static const char promo_chars[] = "nbrq";
+    char *p = strchr(promo_chars, lan.buf[4]);
+    if (!p || !lan.buf[4]) return 0;
+    promo = KNIGHT + (p - promo_chars);
+  }
+  return MAKE_MOVE(from, to, promo);
+}
+
+/*
+legal_lan_moves returns the legal moves in a position as LAN spans, in the same form that get_legal_lan_moves used to get from stockfish with "go perft 1".
+*/
+
+spans legal_lan_moves(Board *b) {
+  Move list[MAX_MOVES];
+  int n = gen_legal_moves(b, list);
+  spans ret = spans_alloc(n);
+  for (int i = 0; i < n; i++) ret.s[i] = move_lan(list[i]);
+  return ret;
+}
+
+/*
+perft counts the leaf nodes of the tree of legal moves to the given depth, which is the standard way to check a move generator: the counts for a handful of well-known positions are published, and any bug in castling, en passant, promotions, or pins shows up as a wrong count.
+--perft <depth> [fen] prints the count below each legal move and the total, in the same form as stockfish's "go perft", so that a difference can be narrowed down by comparing with stockfish move by move, and exits (see run_perft).
+perft() in functions.sh checks the published counts for six standard positions.
+*/
+
+long long perft(Board *b, int depth) {
+  Move list[MAX_MOVES];
+  int n = gen_legal_moves(b, list);
+  if (depth <= 1) return depth == 1 ? n : 1;
+  long long nodes = 0;
+  for (int i = 0; i < n; i++) {
+    Board copy = *b;
+    make_move(&copy, list[i]);
+    nodes += perft(&copy, depth - 1);
+  }
+  return nodes;
+}
+
+void run_perft(int depth, char *fen) {
+  Board b;
+  if (!board_from_fen(&b, S(fen ? fen : STARTPOS_FEN))) {
+    prt("Invalid FEN: %s\n", fen);
+    exit2(1);
+  }
+  Move list[MAX_MOVES];
+  int n = gen_legal_moves(&b, list);
+  long long total = 0;
+  for (int i = 0; i < n && depth > 0; i++) {
+    Board copy = b;
+    make_move(&copy, list[i]);
+    long long nodes = perft(&copy, depth - 1);
+    span lan = move_lan(list[i]);
+    prt("%.*s: %lld\n", len(lan), lan.buf, nodes);
+    total += nodes;
+  }
+  prt("\nNodes searched: %lld\n", depth > 0 ? total : 1);
+  flush();
+  exit(0);
+}
+
+/*
+board_hash gives a 64-bit Zobrist hash of the position, which we use as the key for the eval cache (see eval_cache_lookup).
+
+There is one random number for each piece on each square, for each castling right, for each en passant file, and for the side to move, and the hash is the xor of the numbers for everything that is true of the position.
+The numbers come from a fixed seed, since the hashes are stored on disk and must be the same from one run to the next.
+We only count the en passant file when a pawn could actually capture there, as stockfish does, since the same position reached with and without a double pawn push is otherwise the same position.
+The halfmove clock and the move number are not part of the hash.
+*/
+
+u64 zobrist_pieces[2][6][64], zobrist_castling[4], zobrist_ep[8], zobrist_black;
+
+u64 splitmix64(u64 *state) {
+  u64 z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void init_zobrist() {
+  static int done = 0;
+  if (done) return;
+  u64 state = 0x62706121; // any fixed seed will do, but it must never change
+  for (int c = 0; c < 2; c++)
+    for (int t = 0; t < 6; t++)
+      for (int sq = 0; sq < 64; sq++) zobrist_pieces[c][t][sq] = splitmix64(&state);
+  for (int i = 0; i < 4; i++) zobrist_castling[i] = splitmix64(&state);
+  for (int i = 0; i < 8; i++) zobrist_ep[i] = splitmix64(&state);
+  zobrist_black = splitmix64(&state);
+  done = 1;
+}
+
+u64 board_hash(Board *b) {
+  init_zobrist();
+  init_attack_tables();
+  u64 h = 0;
+  for (int c = 0; c < 2; c++)
+    for (int t = 0; t < 6; t++)
+      for (u64 bb = b->pieces[c][t]; bb; bb &= bb - 1) h ^= zobrist_pieces[c][t][lsb(bb)];
+  for (int i = 0; i < 4; i++) if (b->castling & (1 << i)) h ^= zobrist_castling[i];
+  int us = b->side_to_move;
+  if (b->ep_square != -1 && (pawn_attacks[!us][b->ep_square] & b->pieces[us][PAWN])) h ^= zobrist_ep[b->ep_square % 8];
+  if (us == BLACK) h ^= zobrist_black;
+  return h;
 }
 
 /*
@@ -651,6 +1436,13 @@ typedef struct {
   int num_variations; // Number of variations
   MoveEvaluation *evals; // Eval of every legal move from this position
   int n_evals; // number of evals; equal to number of legal moves at this point
+  int analysis_ms; // how long to search this position, set by plan_analysis_times
+  int analysis_depth; // if not 0, search to this depth instead (the first pass of --two-tier)
+  spans searchmoves; // if not empty, search only these moves (the second pass of --two-tier)
+  int searched_ms; // how long stockfish actually searched this position, over all searches
+  int depth; // the greatest depth stockfish reached on this position, over all searches
+  int triage; // if not 0, this position only had the single-PV triage search, so there is only the best move's eval (see --triage)
+  Board board; // the position before this move, filled in by populate_lan_moves
 } move;
 
 /*
@@ -667,6 +1459,7 @@ typedef struct {
   move *moves;             // Array of moves
   int move_count;          // Number of moves in the array
   spans startpos_comments; // comments on the starting position (before move 1)
+  span result;             // the game termination marker, e.g. "1-0", or a null span if there was none
 } Game;
 
 /*
@@ -679,29 +1472,38 @@ typedef struct {
  * and the move text (standard algebraic notation), ignoring annotations and variations for simplicity.
  * The function dynamically allocates memory for an array of spans, each representing a single move,
  * and returns a Game structure containing this array and the move count.
+ *
+ * The input may contain any number of games, one after another as in a PGN database.
+ * Each call parses the next game and leaves the input positioned after it, and returns 1,
+ * or returns 0 without touching the Game if there are no more games in the input.
  */
 
 // Global flag for enabling debugging output
 int debug_mode = 0;
 
 // Parser functions declarations
-void parse_pgn(span *input, Game *game);
+int parse_pgn(span *input, Game *game);
 void parse_tag_section(span *input, Game *game);
 void parse_move_section(span *input, Game *game);
 span parse_tag(span *input);
 span parse_result(span *input);
 
-void parse_pgn(span *input, Game *game) {
+int parse_pgn(span *input, Game *game) {
   if (debug_mode) {
     prt("Entering parse_pgn\n");
   }
 
+  skip_whitespace(input);
+  if (empty(*input)) return 0; // No more games
+
   parse_tag_section(input, game);
   parse_move_section(input, game);
+  skip_whitespace(input);
 
   if (debug_mode) {
     prt("Leaving parse_pgn\n");
   }
+  return 1;
 }
 
 /*
@@ -860,6 +1662,13 @@ move parse_move(span *input) {
 
   skip_whitespace(input);
 
+  // Skip numeric annotation glyphs like "$1", which are common in databases (we don't roundtrip them)
+  while (input->buf < input->end && *input->buf == '$') {
+    input->buf++;
+    while (input->buf < input->end && isdigit(*input->buf)) input->buf++;
+    skip_whitespace(input);
+  }
+
   // Parse comments
   while (*input->buf == '{') {
     if (m.num_comments >= 10) {
@@ -1051,6 +1860,9 @@ We call a helper function parse_startpos_comments(span*, Game*) to handle all of
 
 In a loop we first try to parse a result, which is one of a fixed number of short strings.
 If parse_result doesn't parse anything we then try to parse a move by calling parse_move, which handles everything from the move number on.
+The result ends the game, and we keep it on the Game so that we can reproduce it in the output.
+Some PGN files leave out the result, so an open square bracket (the start of the tags of the next game) also ends the game.
+If parse_move doesn't consume anything then we have some input we don't understand, and since we would otherwise loop forever we report it and exit.
 
 Everything in the move section will be handled by either parse_move or parse_result, i.e. comments and variations are both handled inside of parse_move.
 
@@ -1071,7 +1883,9 @@ void parse_move_section(span *input, Game *game) {
   game->moves = malloc(capacity * sizeof(move));
   game->move_count = 0;
 
-  while (input->buf < input->end) {
+  game->result = nullspan();
+
+  while (input->buf < input->end && *input->buf != '[') {
     span resultSpan = parse_result(input);
     if (resultSpan.buf == NULL) { // No game result found, proceed to parse move
       if (game->move_count == capacity) {
@@ -1079,10 +1893,17 @@ void parse_move_section(span *input, Game *game) {
         capacity *= 2;
         game->moves = realloc(game->moves, capacity * sizeof(move));
       }
+      u8 *before = input->buf;
       move mv = parse_move(input); // Parse the next move
+      if (input->buf == before) {
+        prt("Error: unexpected input in move section: %.*s\n", len(first_n(*input, 20)), input->buf);
+        flush();
+        exit(EXIT_FAILURE);
+      }
       game->moves[game->move_count++] = mv; // Add the move to the Game
     } else {
       // If we've parsed a result, it's the end of the move section.
+      game->result = resultSpan;
       break;
     }
   }
@@ -1208,34 +2029,36 @@ Therefore we need to consider both the current position and potentially the set
 
 Here's our approach:
 
-1. Get position from stockfish as FEN string.
+1. Get the current position from our own Board (this used to be a FEN string from stockfish).
 2. Get candidate starting squares from the position, according to the piece type (or pawn file) and any disambiguation in the SAN.
     - for example, if the SAN move is R8c6 then we only find rooks on the 8th rank (however, we will consider any rook on the 8th rank, regardless of the file, we do not also restrict to the c file, because we don't want this function to have to know how the rook moves; that is handled by the next step).
-3. Get legal moves as LAN from stockfish if needed for disambiguation. (If there is more than one piece of the given type (or pawn on the given file) on the board (and matching the SAN disambiguation if any) then only one of them can be a legal move, because otherwise the SAN would have contained further disambiguation.)
+3. Get legal moves as LAN from the Board if needed for disambiguation. (If there is more than one piece of the given type (or pawn on the given file) on the board (and matching the SAN disambiguation if any) then only one of them can be a legal move, because otherwise the SAN would have contained further disambiguation.)
+
+Originally steps 1 and 3 were questions to stockfish (the "d" command and "go perft 1"), along with a send_position for every ply, which cost three pipe round-trips per ply before the analysis even started.
+The functions that did this are still below (poll_stockfish, get_legal_lan_moves, get_fen_from_stockfish) but SAN to LAN no longer talks to stockfish at all.
 
 */
 /* void poll_stockfish(span, int, StockfishProcess*);
 
-We read from stockfish in a loop, waiting a few ms each time, until the output contains the string provided.
+We read from stockfish in a loop until the output since the highwater mark contains the string provided.
 If that never happens, we will loop forever.
 To prevent this, we limit the maximum wait time to the second argument, which is in milliseconds.
 If the limit is reached, we print a warning and exit the process.
+
+We used to sleep 10ms between reads, which meant that even a command that stockfish answers in microseconds cost at least 10ms, and we rescanned all of the new output each time.
+Now we block in wait_for_stockfish until output arrives or the deadline passes, so we wake up as soon as stockfish answers, and we only scan the bytes that are new since the last read.
 */
 
 void poll_stockfish(span target, int max_wait_ms, StockfishProcess *sp) {
-  int total_wait = 0;
-  int wait_interval_ms = 10; // Interval to wait between polls in milliseconds
-  span new_output = (span){sp->cmp_highwater, cmp.end};
-  while (!contains(new_output, target)) {
-    usleep(wait_interval_ms * 1000); // Sleep for wait_interval_ms milliseconds
-    read_from_stockfish(sp); // Read the current output from Stockfish
-    new_output.end = cmp.end;
-    total_wait += wait_interval_ms;
-    if (total_wait > max_wait_ms) {
+  long long deadline = now_ms() + max_wait_ms;
+  while (!stockfish_new_output_contains(sp, target)) {
+    long long remaining = deadline - now_ms();
+    if (remaining <= 0) {
       prt("Warning: Max wait time of %d ms exceeded while waiting for \"%.*s\".\n", max_wait_ms, len(target), target.buf);
       flush();
       exit(EXIT_FAILURE);
     }
+    if (wait_for_stockfish(sp, remaining)) read_from_stockfish(sp); // Read the current output from Stockfish
   }
 }
 
@@ -1327,7 +2150,7 @@ spans get_legal_lan_moves(StockfishProcess *sp) {
   return moves;
 }
 
-void populate_lan_moves(Game*, StockfishProcess*);
+void populate_lan_moves(Game*);
 
 void send_position(StockfishProcess *sp, Game *game, int upto_move);
 span correlate_san_with_lan(span san_move, spans legal_lan_moves);
@@ -1375,8 +2198,8 @@ void pretty_print_san_details(SanDetails details) {
 /*
 In populate_lan_moves, we are given a Game which has SAN moves from the PGN, but does not have the LAN moves that we need for stockfish.
 
-To get the LAN moves, for each move in the game, we
-- tell stockfish the current position by the send_position() helper function.
+To get the LAN moves, we keep a Board which starts in the initial position, and for each move in the game, we
+- record the current position on the move, since we need it again for the analysis.
 - parse the SAN to get:
   - the piece (or pawn) type that was moved, one of R N B Q K or a-h for a pawn move, and
   - the disambiguation information if any, which can be a rank, a file, or neither or both, and
@@ -1384,11 +2207,11 @@ To get the LAN moves, for each move in the game, we
   - the piece promoted to if the move was a pawn promotion, and
   - the check or checkmate indication, which our san parsing function also finds but which we aren't using here.
   - we pass i % 2 == 0 into parse_san_details since it needs to know the move for handling castles
-- get the position as FEN from stockfish
-- call a helper function which uses the parsed SAN and the FEN info to return the square containing the piece that moved
-  - this function can optionally call stockfish to get the legal moves, which is also uses if needed
+- call a helper function which uses the parsed SAN and the Board to return the square containing the piece that moved
+  - this function uses the legal moves in the position if needed to disambiguate
 - then we simply concatenate the algebraic start square and end square, along with the lowercased promotion piece, if there is one, to get the LAN move which is always 4 or 5 chars, 5 being in the case of pawn promotions.
 - add this LAN move to the move.lan
+- check that the move is one of the legal moves and make it on the Board; if it isn't legal then either the PGN or our SAN parsing is wrong, and we report this and exit.
 
 Invariant: we always have a LAN move for moves prior to the current move, and we don't have LAN moves for any later ones.
 Once we have reached the end of the game then all the LAN moves are populated and we are done.
@@ -1396,25 +2219,27 @@ Once we have reached the end of the game then all the LAN moves are populated an
 
 SanDetails parse_san_details(span, int);
 void get_fen_from_stockfish(StockfishProcess*, char*, size_t);
-void find_start_square(char *fen, SanDetails san_details, char *start_square, StockfishProcess *sp);
+void find_start_square(Board *board, SanDetails san_details, char *start_square);
 void assign_lan_move(move*, char*);
+int find_legal_move(Board *board, Move m);
 
-void populate_lan_moves(Game *game, StockfishProcess *sp) {
-  char fen[256]; // Buffer to hold FEN string
+void populate_lan_moves(Game *game) {
+  Board board;
+  board_startpos(&board);
 
   for (int i = 0; i < game->move_count; ++i) {
-    // Set position in Stockfish up to the current move
-    send_position(sp, game, i);
+    // Remember the position before this move
+    game->moves[i].board = board;
 
     // Parse the SAN details for the current move
     SanDetails san_details = parse_san_details(game->moves[i].san, i % 2 == 0);
 
-    // Get the current position as FEN from Stockfish
-    get_fen_from_stockfish(sp, fen, sizeof(fen));
-
-    // Find the starting square based on FEN and parsed SAN details
+    // Find the starting square based on the board and parsed SAN details
+    // (the candidate squares and legal moves it allocates are only needed here, since we keep just the LAN, so a batch of many games doesn't fill the span arena)
     char start_square[3]; // Buffer to hold the starting square
-    find_start_square(fen, san_details, start_square, sp);
+    span_arena_push();
+    find_start_square(&board, san_details, start_square);
+    span_arena_pop();
 
     // Construct the LAN move by concatenating the start square, the destination square,
     // and optionally the lowercased promotion piece
@@ -1425,37 +2250,85 @@ void populate_lan_moves(Game *game, StockfishProcess *sp) {
       snprintf(lan_move, sizeof(lan_move), "%s%s", start_square, san_details.destination_square);
     }
 
-    // Assign the constructed LAN move to the current move in the game
-    assign_lan_move(&game->moves[i], lan_move);
+    // Play the move on our board, after making sure that it is legal
+    Move m = move_from_lan(S(lan_move));
+    if (!find_legal_move(&board, m)) {
+      prt("Error: illegal move %.*s (%s) at ply %d.\n", len(game->moves[i].san), game->moves[i].san.buf, lan_move, i + 1);
+      flush();
+      exit(EXIT_FAILURE);
+    }
+    make_move(&board, m);
+
+    // The LAN for the move, from move_lan (this used to be copied into cmp by assign_lan_move, which grew with the input)
+    game->moves[i].lan = move_lan(m);
   }
 }
 
 /*
-In send_position, we construct a position string which contains "position startpos moves" followed by all the moves up to the argument passed in.
-We get the LAN format that stockfish uses and separate them by spaces.
-Then we send this string to stockfish, putting it in the position at that point in the game.
+find_legal_move returns true if the given move is one of the legal moves on the board.
+*/
+
+int find_legal_move(Board *board, Move m) {
+  Move list[MAX_MOVES];
+  int n = gen_legal_moves(board, list);
+  for (int i = 0; i < n; i++) if (list[i] == m) return 1;
+  return 0;
+}
+
+/*
+In send_position, we construct a position string which puts stockfish in the position at that point in the game (i.e. before the move with index upto_move), and send it.
+
+We used to send "position startpos moves" followed by all the moves up to that point.
+That is quadratic in the length of the game, both in the bytes we send and in the moves stockfish replays, and long games overflowed our fixed buffer.
+Now we use the Board which populate_lan_moves stored on each move.
+We could send just "position fen" with the current position, but then stockfish wouldn't know the moves that led to it and couldn't see repetitions, which matter a lot to us since a repetition is a draw.
+However, no position before the last capture or pawn move can ever repeat, and the halfmove clock tells us how many plies ago that was.
+So we send "position fen" with the position right after the last capture or pawn move, followed by "moves" and the (at most a few dozen, in practice) moves since then.
+This is bounded by the halfmove clock rather than the game length, and stockfish still has the complete history that matters for repetitions.
+In the very unlikely case that even this doesn't fit our buffer, we send just the current position as a FEN.
+
+board_at gives us the position before the move with the given index, which may be move_count, i.e. the position after the last move.
 */
 
+Board board_at(Game *game, int ply) {
+  if (ply < game->move_count) return game->moves[ply].board;
+  assert(ply == game->move_count && ply > 0);
+  Board b = game->moves[ply - 1].board;
+  make_move(&b, move_from_lan(game->moves[ply - 1].lan));
+  return b;
+}
+
 void send_position(StockfishProcess *sp, Game *game, int upto_move) {
-  // Start with setting the position to the start position
-  char position_str[4096] = "position startpos moves";
-  int len = strlen(position_str);
+  char position_str[4096];
+  char fen[256];
+  if (upto_move > game->move_count) upto_move = game->move_count;
+  if (upto_move == 0) {
+    send_to_stockfish(sp, "position startpos\n");
+    return;
+  }
 
-  // Append each LAN move up to the specified move number, separated by spaces
-  for (int i = 0; i < upto_move && i < game->move_count; ++i) {
-    // Assuming LAN moves are stored in game->moves[i].lan
+  // Start from the position after the last capture or pawn move
+  Board current = board_at(game, upto_move);
+  int from_ply = upto_move - current.halfmove_clock;
+  if (from_ply < 0) from_ply = 0;
+  Board start = board_at(game, from_ply);
+  board_to_fen(&start, fen, sizeof(fen));
+  int len = snprintf(position_str, sizeof(position_str), "position fen %s moves", fen);
+
+  // Append each LAN move since then, separated by spaces
+  for (int i = from_ply; i < upto_move; ++i) {
     int move_len = game->moves[i].lan.end - game->moves[i].lan.buf;
 
     // Check if the move fits into the remaining buffer space, accounting for the space and null terminator
-    if (len + move_len + 2 < sizeof(position_str)) {
-      position_str[len++] = ' '; // Add space before the move
-      strncpy(position_str + len, (char*)game->moves[i].lan.buf, move_len);
-      len += move_len;
-    } else {
-      // Handle error: position string buffer overflow
-      prt("Error: position string buffer overflow.\n"); flush();
-      exit(EXIT_FAILURE);
+    if (len + move_len + 2 >= sizeof(position_str)) {
+      // Give up on the history and send only the current position
+      board_to_fen(&current, fen, sizeof(fen));
+      len = snprintf(position_str, sizeof(position_str), "position fen %s", fen);
+      break;
     }
+    position_str[len++] = ' '; // Add space before the move
+    memcpy(position_str + len, game->moves[i].lan.buf, move_len);
+    len += move_len;
   }
 
   // Null-terminate the position string
@@ -1573,7 +2446,7 @@ After sending "d\n", get_fen_from_stockfish polls until "Fen" appears, and then
 
 We only care about the FEN, so we parse it line by line until we find a line starting with "Fen: ",
 strip this prefix, and return the FEN string in the buffer provided by the caller.
- *** manually fixed to start from sp->cmp_highwater instead of cmp.buf *** (can use the method for this)
+ *** manually fixed to start from sp->highwater instead of cmp.buf *** (can use the method for this)
 */
 
 void get_fen_from_stockfish(StockfishProcess *sp, char *fen, size_t fen_size) {
@@ -1589,7 +2462,7 @@ void get_fen_from_stockfish(StockfishProcess *sp, char *fen, size_t fen_size) {
   // At this point, cmp contains the output including "Fen"
   // Parse cmp line by line to find the FEN string
   //char *line_start = (char *)cmp.buf;
-  char *line_start = (char *)sp->cmp_highwater;
+  char *line_start = (char *)sp->highwater;
   char *fen_start;
   while ((line_start = strstr(line_start, "\n")) != NULL) {
     // Move past the newline character
@@ -1618,22 +2491,22 @@ void get_fen_from_stockfish(StockfishProcess *sp, char *fen, size_t fen_size) {
 }
 
 /*
-In find_start_square we get a FEN string, a parsed SanDetails from a SAN move, and a destination buffer which will always be at least 3 chars long.
-We also have the StockfishProcess, which we may need to get a list of legal moves if needed to find a unique solution.
+In find_start_square we get the Board, a parsed SanDetails from a SAN move, and a destination buffer which will always be at least 3 chars long.
+(This used to get a FEN string and the StockfishProcess, which it used to get the list of legal moves from stockfish; now the Board gives us both.)
 
 First we find all the squares in the position that contain a piece of the type that moved.
 In the case of a pawn move, this already includes the file that the pawn is on, which along with the destination square uniquely determines the starting square of the move.
 
 In the case of a piece, we narrow the list of potential starting squares by the SAN disambiguation if any.
 However, there may still be more than one piece of the given type in our list.
-If this is the case, we then get the legal moves from stockfish; these will be in the LAN format.
+If this is the case, we then get the legal moves from the Board; these will be in the LAN format.
 If there was no disambiguation in the SAN move, it is because only one of the pieces of the given type can reach the destination square.
 In this case we determine the starting square by looking for a legal move which has a starting square from our list, and there will only be one such.
  *** editing because the above was wrong ***
 In this case we determine the starting square by looking for a legal move which has a starting square from our list and the destination square matching the SAN.
 
 Examples:
-Q8xd7. We find all the queens (of the right color) from the FEN, then filter out any that are not on the 8th rank. This gives a list of candidate starting squares. If there is more than one, that means there are two queens on the 8th rank; we then ask stockfish for the legal moves; only one of the queens will be able to reach the destination square, so we are done.
+Q8xd7. We find all the queens (of the right color) on the board, then filter out any that are not on the 8th rank. This gives a list of candidate starting squares. If there is more than one, that means there are two queens on the 8th rank; we then get the legal moves; only one of the queens will be able to reach the destination square, so we are done.
 Be3. In most cases there may be two bishops, and we will find the squares they are not and get the legal moves to see which one can reach the destination.
 e4. In this case it is already unambiguous since only one pawn can ever reach any given square without capture.
 fxe4. The capture case is also unambiguous since the starting file is given for pawn captures.
@@ -1642,22 +2515,21 @@ First we'll call a helper function that finds the squares that are compatible wi
 This will return a spans with the candidate algebraic square names.
 If this list has only one element then we are done, and we put it in start_square and return.
 Otherwise, the list has more than one element.
-We get the legal moves from stockfish, which also gives us a spans.
+We get the legal moves from legal_lan_moves, which also gives us a spans.
 Then we loop over the candidate squares and, inside that, over the legal moves, and the first match that we find will be the result.
 If we haven't found any match, some assumption in our code is incorrect so we report the error and simply crash.
 We can also create a helper function to determine whether a candidate square is the start square of a LAN move.
 */
 
 // Declaration for the helper functions assumed by the find_start_square implementation
-spans find_candidate_squares(char *fen, SanDetails san_details);
+spans find_candidate_squares(Board *board, SanDetails san_details);
 int is_start_square_of_lan_move(span candidate_square, span lan_move);
 int is_destination_square_match(span lan_move, SanDetails san_details);
 
-void find_start_square(char *fen, SanDetails san_details, char *start_square, StockfishProcess *sp) {
-  //prt("find_start_square: %s\n", fen);
+void find_start_square(Board *board, SanDetails san_details, char *start_square) {
   //pretty_print_san_details(san_details);
   // Find candidate starting squares based on the piece and any disambiguation
-  spans candidate_squares = find_candidate_squares(fen, san_details);
+  spans candidate_squares = find_candidate_squares(board, san_details);
   //dbgd(candidate_squares.n);
 
   if (candidate_squares.n == 1) {
@@ -1665,8 +2537,8 @@ void find_start_square(char *fen, SanDetails san_details, char *start_square, St
     strncpy(start_square, (char*)candidate_squares.s[0].buf, 2);
     start_square[2] = '\0'; // Ensure null-termination
   } else {
-    // If more than one candidate, get legal moves from Stockfish to resolve ambiguity
-    spans legal_moves = get_legal_lan_moves(sp);
+    // If more than one candidate, get legal moves from the board to resolve ambiguity
+    spans legal_moves = legal_lan_moves(board);
 
     // Iterate over candidate squares and legal moves to find a match
     int found = 0;
@@ -1697,61 +2569,53 @@ void find_start_square(char *fen, SanDetails san_details, char *start_square, St
 }
 
 /*
-To find candidate squares we iterate over the FEN string, and we find each square containing the piece and color given by the SAN details.
-We have a static string of length 128 that contains all the square names in the same layout as FEN (i.e. a8 through h1 in memory) and we construct spans (each of len() 2) that point into that.
-We have a helper function that takes a single char from the FEN, the file, and our SanDetails and returns whether or not the square is a potential match.
+To find candidate squares we iterate over the squares of the Board, and we find each square containing the piece and color given by the SAN details.
+We have a static string of length 128 that contains all the square names in the same order as our square numbering (i.e. a1 through h8 in memory) and we construct spans (each of len() 2) that point into that.
+We have a helper function that takes a single FEN char (which is how the Board stores pieces), the file, and our SanDetails and returns whether or not the square is a potential match.
 (The file is needed only for pawns.)
 If there is disambiguation info in the SAN we only return the squares that are consistent with it, otherwise any square that has the right kind of piece; we declare a helper function first that handles this disambiguation info.
-For pawn moves, the result should always already be deterministic; we have a file in piece_moved and we remember that "p" or "P" is in the FEN.
-FEN uses digits to indicate runs of blank squares, we handle these by incrementing the file we are on.
-We use the rank and file to index into the square names correctly.
+For pawn moves, the result should always already be deterministic; we have a file in piece_moved and we remember that "p" or "P" is the FEN char.
 We use spans_alloc for the return variable.
 Note that spans_alloc returns a spans with .n set to the size provided, so we use a separate variable result_count to track the number of results and set .n at the end.
 We can allocate space for 10 spans as that is a maximum number of possible pieces of the same type that can be on the board in standard chess.
+(This used to walk a FEN string from stockfish, handling digits for runs of empty squares and the rank separators.)
 */
 
 int square_matches_piece(char fen_char, int file, char piece, int is_white_move);
 int matches_disambiguation(const char *square, const char *disambiguation);
 
-spans find_candidate_squares(char *fen, SanDetails san_details) {
-  static const char square_names[] = 
-    "a8b8c8d8e8f8g8h8"
-    "a7b7c7d7e7f7g7h7"
-    "a6b6c6d6e6f6g6h6"
-    "a5b5c5d5e5f5g5h5"
-    "a4b4c4d4e4f4g4h4"
-    "a3b3c3d3e3f3g3h3"
+spans find_candidate_squares(Board *board, SanDetails san_details) {
+  static const char square_names[] =
+    "a1b1c1d1e1f1g1h1"
     "a2b2c2d2e2f2g2h2"
-    "a1b1c1d1e1f1g1h1";
+    "a3b3c3d3e3f3g3h3"
+    "a4b4c4d4e4f4g4h4"
+    "a5b5c5d5e5f5g5h5"
+    "a6b6c6d6e6f6g6h6"
+    "a7b7c7d7e7f7g7h7"
+    "a8b8c8d8e8f8g8h8";
 
   spans result = spans_alloc(10); // Allocate space for up to 10 candidate squares
   int result_count = 0;
 
-  int square_index = 0; // Index to iterate over square_names
-  int rank = 8, file = 0; // Start from the 8th rank and 'a' file
+  for (int sq = 0; sq < 64; ++sq) {
+    char fen_char = board->squares[sq];
+    if (!fen_char) continue; // Empty square
 
-  for (int fen_index = 0; fen[fen_index] != ' '; ++fen_index) {
-    char fen_char = fen[fen_index];
-    if (fen_char == '/') {
-      rank--; // Move to the next rank
-      file = 0; // Reset file to 'a'
-      continue;
-    }
+    int file = sq % 8;
+    if (square_matches_piece(fen_char, file, san_details.piece_moved, san_details.is_white_move)) {
+      const char *current_square = square_names + sq * 2;
+      char square[3] = {current_square[0], current_square[1], '\0'};
 
-    if (isdigit(fen_char)) {
-      file += fen_char - '0'; // Skip empty squares
-    } else {
-      if (square_matches_piece(fen_char, file, san_details.piece_moved, san_details.is_white_move)) {
-        char current_square[3] = {file + 'a', rank + '0', '\0'};
-
-        if (matches_disambiguation(current_square, san_details.disambiguation)) {
-          // Construct a span for the current square and add to result
-          int name_index = ((8 - rank) * 16) + (file * 2); // Calculate index in square_names
-          result.s[result_count] = (span){(u8*)square_names + name_index, (u8*)square_names + name_index + 2};
-          result_count++;
+      if (matches_disambiguation(square, san_details.disambiguation)) {
+        if (result_count == 10) {
+          prt("Error: too many candidate squares for move.\n"); flush();
+          exit(EXIT_FAILURE);
         }
+        // Construct a span for the current square and add to result
+        result.s[result_count] = (span){(u8*)current_square, (u8*)current_square + 2};
+        result_count++;
       }
-      file++; // Move to the next file
     }
   }
 
@@ -1918,7 +2782,203 @@ void assign_lan_move(move *m, char *lan_move) {
   assert(len(m->lan) == 4 || len(m->lan) == 5);
 }
 
-void do_analysis(Game*, StockfishProcess*);
+/* Eval cache
+
+A PGN database shares long opening prefixes between its games, the same positions come up again by transposition, and we often annotate a database again after adding a few games to it.
+So with --cache <file> we keep the evals of every position that we analyze in a file, and in do_analysis we look each position up there before we ask stockfish, so that only new positions cost engine time.
+
+The key is the board_hash of the position xored with a hash of the analysis settings, i.e. the movetime, the MultiPV, the engine's "id name" line, and anything else that changes the evals we get (see describe_analysis_settings).
+Changing any of these just means starting with a cold cache, rather than getting evals that were made with other settings.
+The value is the list of evals, with each move stored as its 16-bit Move code along with the cp eval.
+We don't hash the move history, so a position where stockfish saw a repetition draw coming may get the evals from the same position reached without that history, which we accept.
+
+The file starts with EVAL_CACHE_MAGIC and is then an append-only log of records, each an EvalCacheRecord followed by n_evals EvalCacheEntry.
+When we open the file we map it and index every record in an open-addressing hash table in memory, pointing into the mapping.
+A record cut short at the end of the file (e.g. if we were killed while writing it) is truncated away.
+New records are appended with a single write() as soon as each game has been analyzed, and indexed as well, pointing to a heap copy since they are past the end of the mapping.
+If a key occurs more than once, the later record wins.
+
+Appending is the only way the file changes, so the cache can never be left in a state where a complete record is wrong, and copying the file or deleting it are both safe ways to manage it.
+
+Without --cache there is no file, but we still keep the index in memory for the whole run, so when the input has many games each position is analyzed only once and every later game that reaches it gets the same evals.
+The games of a tournament or an opening database mostly share their first ten or twenty plies, so this is where most of the engine time on such files would otherwise go.
+Since positions deeper into the game are rarely shared, and keeping every one of them would make memory grow with the size of the input, without a file we only remember the positions of the first dedupe_plies plies of each game (see do_analysis).
+*/
+
+#define EVAL_CACHE_MAGIC "bpacach1"
+
+typedef struct {
+  u64 key;
+  int n_evals;
+  int pad; // always 0, keeps the entries 8-byte aligned
+} EvalCacheRecord;
+
+typedef struct {
+  int move; // the Move code
+  int cp_eval;
+} EvalCacheEntry;
+
+int eval_cache_fd = -1; // -1 if there is no cache file, in which case the index is only in memory
+int dedupe_plies = 40;  // without a cache file, how many plies into each game we remember positions
+u64 eval_cache_settings; // the settings part of every key
+u64 *eval_cache_keys;    // hash table of keys, 0 for an empty slot
+EvalCacheRecord **eval_cache_recs; // the record for each key
+size_t eval_cache_cap, eval_cache_n;
+int eval_cache_hits, eval_cache_misses;
+
+u64 fnv1a64(span s) {
+  u64 h = 0xcbf29ce484222325ULL;
+  for (u8 *p = s.buf; p < s.end; p++) h = (h ^ *p) * 0x100000001b3ULL;
+  return h;
+}
+
+u64 eval_cache_key(Board *b) {
+  u64 key = board_hash(b) ^ eval_cache_settings;
+  return key ? key : 1; // 0 marks an empty slot
+}
+
+size_t eval_cache_slot(u64 key) {
+  size_t i = key & (eval_cache_cap - 1);
+  while (eval_cache_keys[i] && eval_cache_keys[i] != key) i = (i + 1) & (eval_cache_cap - 1);
+  return i;
+}
+
+void eval_cache_index(EvalCacheRecord *rec) {
+  if (2 * (eval_cache_n + 1) > eval_cache_cap) {
+    // Grow to keep the load factor under one half, and re-insert everything
+    u64 *old_keys = eval_cache_keys;
+    EvalCacheRecord **old_recs = eval_cache_recs;
+    size_t old_cap = eval_cache_cap;
+    eval_cache_cap = old_cap ? old_cap * 2 : 1024;
+    eval_cache_keys = calloc(eval_cache_cap, sizeof(u64));
+    eval_cache_recs = calloc(eval_cache_cap, sizeof(EvalCacheRecord*));
+    if (!eval_cache_keys || !eval_cache_recs) {
+      prt("Memory allocation failed\n");
+      exit2(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+      if (!old_keys[i]) continue;
+      size_t j = eval_cache_slot(old_keys[i]);
+      eval_cache_keys[j] = old_keys[i];
+      eval_cache_recs[j] = old_recs[i];
+    }
+    free(old_keys);
+    free(old_recs);
+  }
+  size_t i = eval_cache_slot(rec->key);
+  if (!eval_cache_keys[i]) eval_cache_n++;
+  eval_cache_keys[i] = rec->key;
+  eval_cache_recs[i] = rec;
+}
+
+/*
+eval_cache_open opens (or creates) the cache file and indexes it, given the settings that go into the key as a string.
+We report and exit if the file can't be opened or isn't a cache file, rather than overwrite something that isn't ours.
+*/
+
+void eval_cache_open(char *path, char *settings) {
+  eval_cache_settings = fnv1a64(S(settings));
+
+  eval_cache_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  struct stat st;
+  if (eval_cache_fd == -1 || fstat(eval_cache_fd, &st) == -1) {
+    perror(path);
+    exit2(EXIT_FAILURE);
+  }
+  size_t size = st.st_size, magic_len = strlen(EVAL_CACHE_MAGIC);
+  if (size == 0) {
+    if (write(eval_cache_fd, EVAL_CACHE_MAGIC, magic_len) != (ssize_t)magic_len) {
+      perror(path);
+      exit2(EXIT_FAILURE);
+    }
+    return;
+  }
+  u8 *map = size < magic_len ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, eval_cache_fd, 0);
+  if (map == MAP_FAILED || memcmp(map, EVAL_CACHE_MAGIC, magic_len)) {
+    prt("%s is not an eval cache file\n", path);
+    exit2(EXIT_FAILURE);
+  }
+  size_t pos = magic_len;
+  while (pos + sizeof(EvalCacheRecord) <= size) {
+    EvalCacheRecord *rec = (EvalCacheRecord*)(map + pos);
+    size_t rec_size = sizeof(EvalCacheRecord) + rec->n_evals * sizeof(EvalCacheEntry);
+    if (rec->n_evals < 0 || rec->n_evals > MAX_MOVES || pos + rec_size > size) break;
+    eval_cache_index(rec);
+    pos += rec_size;
+  }
+  if (pos < size && ftruncate(eval_cache_fd, pos) == -1) {
+    perror(path);
+    exit2(EXIT_FAILURE);
+  }
+}
+
+/*
+eval_cache_lookup fills in the evals on the move from the cache and returns 1, or returns 0 if the position isn't there.
+The evals are malloc'd just as parse_stockfish_output_2 does it, and the LAN spans come from move_lan, so the move can't tell where its evals came from.
+*/
+
+int eval_cache_lookup(move *m) {
+  size_t i = eval_cache_cap ? eval_cache_slot(eval_cache_key(&m->board)) : 0;
+  if (!eval_cache_cap || !eval_cache_keys[i]) {
+    eval_cache_misses++;
+    return 0;
+  }
+  EvalCacheRecord *rec = eval_cache_recs[i];
+  EvalCacheEntry *entries = (EvalCacheEntry*)(rec + 1);
+  m->evals = malloc(128 * sizeof(MoveEvaluation));
+  if (!m->evals) {
+    prt("Memory allocation failed\n");
+    exit2(EXIT_FAILURE);
+  }
+  m->n_evals = rec->n_evals < 128 ? rec->n_evals : 128;
+  for (int j = 0; j < m->n_evals; j++) {
+    m->evals[j].lan_move = move_lan(entries[j].move);
+    m->evals[j].cp_eval = entries[j].cp_eval;
+  }
+  eval_cache_hits++;
+  return 1;
+}
+
+/*
+eval_cache_store appends the evals on a move that we just analyzed to the cache file, if there is one, and indexes them.
+*/
+
+void eval_cache_store(move *m) {
+  size_t size = sizeof(EvalCacheRecord) + m->n_evals * sizeof(EvalCacheEntry);
+  EvalCacheRecord *rec = malloc(size);
+  if (!rec) {
+    prt("Memory allocation failed\n");
+    exit2(EXIT_FAILURE);
+  }
+  rec->key = eval_cache_key(&m->board);
+  rec->n_evals = m->n_evals;
+  rec->pad = 0;
+  EvalCacheEntry *entries = (EvalCacheEntry*)(rec + 1);
+  for (int j = 0; j < m->n_evals; j++) {
+    entries[j].move = move_from_lan(m->evals[j].lan_move);
+    entries[j].cp_eval = m->evals[j].cp_eval;
+  }
+  if (eval_cache_fd != -1 && write(eval_cache_fd, rec, size) != (ssize_t)size) {
+    perror("write eval cache");
+    exit2(EXIT_FAILURE);
+  }
+  eval_cache_index(rec);
+}
+
+/*
+stockfish_engine_name returns the name from the "id name" line that stockfish prints in answer to "uci", or a null span if there isn't one.
+We wait for "uciok", which comes after the id lines, so we must be called right after "uci" is sent.
+*/
+
+span stockfish_engine_name(StockfishProcess *sp) {
+  poll_stockfish(S("uciok"), 60000, sp);
+  span name = spanspan(get_stockfish_new_output(sp), S("id name "));
+  if (empty(name)) return nullspan();
+  consume_prefix(&name, S("id name "));
+  return next_line(&name);
+}
+
+void do_analysis(Game*, StockfishProcess*, int);
 
 /*
 To actually do the analysis, we send each position in the game to stockfish.
@@ -1938,13 +2998,127 @@ The lines may be repeated for the same moves, but we can handle this by parsing
 So in this function we just iterate over all the moves in the game, and call a helper function that does the analysis.
 As we have a place on the move struct to store the evals, here we just call send_position to update the stockfish process with the current position.
 We then call analyze_move to get the evals, and we pass a pointer to the move into this function so that it can store them.
+
+We are given an array of stockfish processes and its length.
+If there is more than one, the positions are independent of each other, so we hand them out to the processes with do_analysis_pool instead.
+
+Before any of that, we look up every position in the eval cache (see eval_cache_lookup), and the positions found there already have their evals, so both loops skip them.
+So for each ply we have same_as, which is -1 if the ply needs analysis, or the ply itself if the cache had it, and both loops only analyze the plies where it is -1.
+Afterwards we store the evals of every position that we analyzed, so the cache holds everything we have analyzed (without a cache file, only up to dedupe_plies).
+
+A position can also occur twice in the same game, but then it is a repetition, and this is exactly the case where the history matters: a move back into an earlier position may now repeat it a third time, which is a draw, and stockfish sees this since send_position gives it the moves since the last capture or pawn move.
+(We used to analyze only the first occurrence and copy its evals to the later one, which gave a green arrow to the drawing move in a won position.)
+So a repeated position (see repeats_earlier) is always analyzed again, and neither looked up in the cache nor stored there, since its evals depend on more than the position.
+
+How long each position is searched is up to plan_analysis_times, which normally gives each one analysis_time_ms.
+With --two-tier, the first pass is a shallow search and plan_two_tier_second_pass chooses which positions (and moves) get the full search.
+With a game budget there is another pass over some of the positions, which plan_budget_second_pass chooses (see --game-budget below).
+The two loops themselves are in analyze_plies.
+(With --batch, run_batch does the same for several games at once, with find_repeats and finish_analysis for the parts before and after the searches.)
+
+With --reverse (reverse_plies), analyze_plies goes through the game from the last ply to the first, with one stockfish process (so without --batch we don't allow more).
+We never send ucinewgame between the plies of a game, so stockfish's hash table is kept from one position to the next, and going backwards the positions it has already searched are the ones that follow from the position it is searching now, which is what the hash table can use: what it found deep in the endgame carries over to the middlegame, so it reaches a greater depth in the same time.
+To see how much, every search records on the move the greatest depth it reached (see parse_stockfish_output_2), and finish_analysis adds up the depths of the positions we searched, for the average depth that --bench and --stats report.
+(With --batch, each worker gets its run of plies of each game in reverse order instead, which keeps most of the benefit.)
 */
 
+int reverse_plies = 0;
+long long depth_total, depth_plies; // over the positions we searched, for the average depth
+
 void analyze_move(StockfishProcess *sp, move *m);
 void analyze_move_2(StockfishProcess *sp, move *m);
+void do_analysis_pool(Game *game, StockfishProcess *engines, int n_engines, int *same_as);
+void copy_evals(move *dst, move *src);
+void analyze_plies(Game *game, StockfishProcess *engines, int n_engines, int *skip);
+void plan_analysis_times(Game *game, int *skip);
+int plan_budget_second_pass(Game *game, int *skip, int *redo);
+int plan_two_tier_second_pass(Game *game, int *skip, int *redo);
+int plan_quick_check_pass(Game *game, int *skip, int *redo);
+int plan_triage_full_pass(Game *game, int *skip, int *redo);
+extern int quick_check; // see plan_quick_check_pass
+extern int triage_depth; // see plan_triage_full_pass
+
+/* repeats_earlier says whether the position before ply i already occurred earlier in the game, which can only be since the last capture or pawn move. */
+
+int repeats_earlier(Game *game, int i) {
+  Board *b = &game->moves[i].board;
+  u64 key = board_hash(b);
+  for (int j = i - 1; j >= 0 && j >= i - b->halfmove_clock; --j) if (board_hash(&game->moves[j].board) == key) return 1;
+  return 0;
+}
+
+/* repeat_key is the key by which we find positions shared between the games of a batch (see batch_link_repeats): the position, and with --quick also the move played from it. */
+
+u64 repeat_key(move *m) {
+  u64 key = eval_cache_key(&m->board);
+  if (quick_check) key ^= (move_from_lan(m->lan) + 1) * 0x9E3779B97F4A7C15ULL;
+  return key;
+}
+
+/* find_repeats returns same_as for the game (see above), looking up every position in the eval cache on the way. */
+
+int *find_repeats(Game *game) {
+  int n = game->move_count;
+  int *same_as = malloc((n + 1) * sizeof(int));
+  if (!same_as) {
+    prt("Memory allocation failed\n");
+    exit2(EXIT_FAILURE);
+  }
+  for (int i = 0; i < n; ++i) {
+    same_as[i] = !repeats_earlier(game, i) && eval_cache_lookup(&game->moves[i]) ? i : -1;
+    plies_analyzed += same_as[i] != -1; // done already, as far as --progress is concerned
+  }
+  return same_as;
+}
 
-void do_analysis(Game *game, StockfishProcess *sp) {
+/* finish_analysis stores the evals of the positions we analyzed in the cache (except for repetitions), and frees same_as. */
+
+void finish_analysis(Game *game, int *same_as) {
   for (int i = 0; i < game->move_count; ++i) {
+    if (same_as[i] == -1) {
+      depth_total += game->moves[i].depth;
+      depth_plies++;
+      if (game->moves[i].triage) continue; // only the best move's eval, which is no use to anyone else
+      if (repeats_earlier(game, i)) continue; // the evals depend on the history
+      if (eval_cache_fd != -1 || i < dedupe_plies) eval_cache_store(&game->moves[i]);
+    }
+  }
+  free(same_as);
+}
+
+void do_analysis(Game *game, StockfishProcess *engines, int n_engines) {
+  int n = game->move_count;
+  int *same_as = find_repeats(game);
+
+  plan_analysis_times(game, same_as);
+  analyze_plies(game, engines, n_engines, same_as);
+
+  int *redo = malloc((n + 1) * sizeof(int));
+  if (!redo) {
+    prt("Memory allocation failed\n");
+    exit2(EXIT_FAILURE);
+  }
+  if (plan_two_tier_second_pass(game, same_as, redo)) analyze_plies(game, engines, n_engines, redo);
+  if (plan_budget_second_pass(game, same_as, redo)) analyze_plies(game, engines, n_engines, redo);
+  if (plan_quick_check_pass(game, same_as, redo)) analyze_plies(game, engines, n_engines, redo);
+  if (plan_triage_full_pass(game, same_as, redo)) analyze_plies(game, engines, n_engines, redo);
+  free(redo);
+
+  finish_analysis(game, same_as);
+}
+
+/* analyze_plies analyzes the positions before every ply i where skip[i] is -1, for m->analysis_ms each. */
+
+void analyze_plies(Game *game, StockfishProcess *engines, int n_engines, int *skip) {
+  if (n_engines > 1 && !reverse_plies) {
+    do_analysis_pool(game, engines, n_engines, skip);
+    return;
+  }
+  StockfishProcess *sp = &engines[0];
+  for (int j = 0; j < game->move_count; ++j) {
+    int i = reverse_plies ? game->move_count - 1 - j : j;
+    if (skip[i] != -1) continue;
+
     // Set the position in Stockfish up to the current move
     send_position(sp, game, i);
 
@@ -1953,6 +3127,17 @@ void do_analysis(Game *game, StockfishProcess *sp) {
   }
 }
 
+void copy_evals(move *dst, move *src) {
+  dst->evals = malloc(128 * sizeof(MoveEvaluation));
+  if (!dst->evals) {
+    prt("Memory allocation failed\n");
+    exit2(EXIT_FAILURE);
+  }
+  memcpy(dst->evals, src->evals, src->n_evals * sizeof(MoveEvaluation));
+  dst->n_evals = src->n_evals;
+  dst->triage = src->triage;
+}
+
 /*
 In analyze_move, stockfish already has the position, so we just need to send the "go movetime 1000" command to let it evaluate all the legal moves for 1 second.
 Before we call send_to_stockfish, we first must call set_stockfish_highwater so that we can tell later where the output from this particular command started.
@@ -1999,104 +3184,1042 @@ void analyze_move(StockfishProcess *sp, move *m) {
 // Global variable for Stockfish analysis time in milliseconds
 int analysis_time_ms = 1000; // Default value
 
-void analyze_move_2(StockfishProcess *sp, move *m) {
-  // Set highwater mark for Stockfish output to identify new output generated by this command
-  set_stockfish_highwater(sp);
+// We ask for more lines than there can be legal moves, so that stockfish evaluates every legal move
+#define MULTIPV 500
 
-  // Prepare the command string with the global variable for analysis time
-  char command[256];
-  snprintf(command, sizeof(command), "go movetime %d\n", analysis_time_ms);
+/*
+analyze_move_2 is like analyze_move, but uses the analysis time from the command line and the legal moves from the board to filter out lines from the previous position.
 
-  // Send command to Stockfish to evaluate the position for the specified analysis time
-  send_to_stockfish(sp, command);
+Sleeping for the movetime and then sending "stop" has two problems.
+The engine may finish early (e.g. it finds a mate, or there is only one legal move) and then we sit idle for the rest of the movetime.
+Worse, stockfish only answers "stop" after we have already read its output, so late info lines and the bestmove of this search are still in the pipe when we set the highwater mark for the next position, and they leak into the next parse (which the legal move check only partly hides).
 
-  // Sleep for the specified analysis time to allow Stockfish to evaluate
-  usleep(analysis_time_ms * 1000); // Convert milliseconds to microseconds
+So by default (wait_for_bestmove) we instead wait until stockfish prints its "bestmove" line, which it does exactly once at the end of every search, whether the movetime ran out or the search ended early.
+At that point all of the output of this search is past the highwater mark and none of it can arrive later.
+We wait with poll_stockfish, with a deadline of the movetime plus BESTMOVE_GRACE_MS, and if stockfish hasn't finished by then we give up as poll_stockfish always does.
+The old sleep and stop behavior is still available with --fixed-sleep.
+*/
 
-  // Send "stop" to Stockfish to halt evaluation, in case it's still running
-  send_to_stockfish(sp, "stop\n");
+#define BESTMOVE_GRACE_MS 5000
 
-  // Increase the wait time after sending stop to ensure all output is captured
-  //usleep(250 * 1000); // Wait for an additional 250 milliseconds
+int wait_for_bestmove = 1;
 
-  // Read output from Stockfish
-  read_from_stockfish(sp);
+/*
+Info lines
 
-  // Get the new output generated by our command
-  span output = get_stockfish_new_output(sp);
+Everything we want from stockfish is in its info lines, e.g.
 
-  // Parse the Stockfish output to extract move evaluations and update the move structure
-  spans legal_moves = get_legal_lan_moves(sp); /* *** manual fixup *** */
-  parse_stockfish_output_2(output, m, legal_moves);
+info depth 13 seldepth 22 multipv 1 score cp -26 nodes 681621 nps 680260 hashfull 302 tbhits 0 time 1002 pv g8f6 b1c3 e7e6 c1g5 f8e7 e2e3 e8g8 g5h4 f6e4 h4e7 d8e7 d1c2 e4f6 f1d3 d5c4 d3c4
+
+With MultiPV 500 there is one such line per legal move per depth, so tens of thousands of them per position, and we used to look at each one with a spanspan for " score " and another for " pv " (parse_cp_eval and find_pv_move), and more for " depth " and " multipv ", each of them searching from the start of the line, which is mostly the long PV.
+
+parse_info_line instead reads the line (after "info") once from left to right, a token at a time, and takes the depth, the multipv index, the score, and the first move of the PV, and stops there, so it never looks at the rest of the PV.
+Tokens we don't need (the other keys, and their values) are just skipped one at a time, so it doesn't matter which keys stockfish prints or how many values they have (e.g. wdl has three).
+Once we have the depth, the multipv index, and the score, we don't walk the tokens up to the PV but go straight to " pv " (see find_pv_key), since walking them was most of the time.
+"string" starts free text, so we stop there.
+The score is as parse_cp_eval gives it: mate scores are +-10000, and INT_MIN means the line has no score.
+Missing depth and multipv are -1, and a missing PV is an empty span.
+--bench-parse compares the two ways (see bench_info_parsing).
+*/
+
+typedef struct {
+  int depth;
+  int multipv;
+  int cp;
+  span pv_move;
+} InfoLine;
+
+int info_number(u8 **p, u8 *end) {
+  while (*p < end && **p == ' ') (*p)++;
+  int neg = *p < end && **p == '-';
+  if (neg) (*p)++;
+  int n = 0;
+  while (*p < end && **p >= '0' && **p <= '9') n = n * 10 + *(*p)++ - '0';
+  return neg ? -n : n;
+}
+
+span info_token(u8 **p, u8 *end) {
+  while (*p < end && **p == ' ') (*p)++;
+  span tok = {*p, *p};
+  while (tok.end < end && *tok.end != ' ' && *tok.end != '\n' && *tok.end != '\r') tok.end++;
+  *p = tok.end;
+  return tok;
 }
 
+#define TOKEN_IS(tok, lit) (len(tok) == sizeof(lit) - 1 && memcmp((tok).buf, lit, sizeof(lit) - 1) == 0)
+
 /*
-In parse_stockfish_output, we are given a span containing the "info" lines like those shown above, e.g.:
+find_pv_key finds " pv " between p and end, and returns where it starts, or NULL.
+None of the keys stockfish prints between the score and the PV (nodes, nps, hashfull, tbhits, time, and the rest) has a 'v' in it, nor do numbers, so we look for the 'v' with memchr, which is much faster than memmem here, and then check the chars around it.
+*/
 
-info depth 13 seldepth 22 multipv 1 score cp -26 nodes 681621 nps 680260 hashfull 302 tbhits 0 time 1002 pv g8f6 b1c3 e7e6 c1g5 f8e7 e2e3 e8g8 g5h4 f6e4 h4e7 d8e7 d1c2 e4f6 f1d3 d5c4 d3c4
+u8 *find_pv_key(u8 *p, u8 *end) {
+  while (p + 2 < end) {
+    u8 *v = memchr(p + 2, 'v', end - p - 2);
+    if (!v || v + 1 >= end) return NULL;
+    if (v[-2] == ' ' && v[-1] == 'p' && v[1] == ' ') return v - 2;
+    p = v - 1;
+  }
+  return NULL;
+}
 
-Here is another sample line that indicates a forced checkmate line, in this case, mate in one for the other player if c2a4 is played by this player.
+void parse_info_line(span line, InfoLine *info) {
+  info->depth = -1;
+  info->multipv = -1;
+  info->cp = INT_MIN;
+  info->pv_move = nullspan();
+  u8 *p = line.buf, *end = line.end;
+  while (p < end) {
+    while (p < end && *p == ' ') p++;
+    if (p == end) break;
+    // Most tokens are the values of keys we skip (nodes, nps, time, ...), so numbers are passed over without making a token of them
+    if ((*p >= '0' && *p <= '9') || *p == '-') {
+      while (p < end && *p != ' ') p++;
+      continue;
+    }
+    span tok = info_token(&p, end);
+    if (empty(tok)) break;
+    // Then we look at the first char before comparing whole tokens
+    switch (tok.buf[0]) {
+    case 'd':
+      if (TOKEN_IS(tok, "depth")) info->depth = info_number(&p, line.end);
+      break;
+    case 'm':
+      if (TOKEN_IS(tok, "multipv")) info->multipv = info_number(&p, line.end);
+      break;
+    case 's':
+      if (TOKEN_IS(tok, "score")) {
+        span kind = info_token(&p, line.end);
+        int value = info_number(&p, line.end);
+        if (TOKEN_IS(kind, "cp")) info->cp = value;
+        else if (TOKEN_IS(kind, "mate")) info->cp = value > 0 ? 10000 : -10000;
+        // Once we have all three numbers, everything before the PV is keys we skip, so we go straight to it
+        if (info->depth >= 0 && info->multipv >= 0) {
+          u8 *pv = find_pv_key(p, end);
+          if (pv) {
+            p = pv + 3;
+            info->pv_move = info_token(&p, end);
+            return;
+          }
+        }
+      } else if (TOKEN_IS(tok, "string")) {
+        return;
+      }
+      break;
+    case 'p':
+      if (TOKEN_IS(tok, "pv")) {
+        info->pv_move = info_token(&p, line.end);
+        return;
+      }
+      break;
+    }
+  }
+}
 
-info depth 232 seldepth 3 multipv 3 score mate -1 nodes 754894 nps 5353858 tbhits 0 time 141 pv c2a4 a8a4
-info depth 1 seldepth 2 multipv 2 score mate 6 nodes 1258 nps 629000 tbhits 0 time 2 pv c7b7 b1a1
+/*
+Adaptive analysis time
 
-From the info line we need only the cp eval (e.g. -26 above) or mate and the first LAN move after the pv, which identifies the first move in the line.
-Since we are evaluating every legal move, there will be one of these for each legal move in the position.
-We extract the LAN move into a span, after checking whether it is four or five chars long.
-We optimistically assume that we can locate the LAN move by searching for " pv ".
+In the end we only use each move's eval through evaluate_position, which puts it in one of three buckets (WINNING, DRAWN, or LOSING), and the arrows only depend on those buckets.
+In a quiet position stockfish usually has every move in its final bucket after a few depths, and the rest of the movetime changes the cp evals but not the arrows.
 
-Sometimes we get a cp eval and sometimes we will get a forced checkmate eval like "score mate -7".
-To handle both cases we can look for " score ", then check whether it is followed by "cp " or "mate ", and then handle the number after that.
-We do not distinguish in our later analysis between mate and extreme centipawn values so we will just replace any mate with a large eval like +10000 or -10000.
-This way we can continue to treat the cp eval as an integer downstream of this parsing function.
+So with --adaptive <K> (adaptive_depths) we read the info lines as they arrive and stop the search once the buckets of all the legal moves have been the same for K complete depths in a row, but not before min_analysis_time_ms.
+The movetime that we send is still the analysis time for the position, which is then the maximum, so positions where the buckets keep changing get the full time.
 
-The input may contain other lines that do not start with "info", which we must ignore.
-We can make one pass over all the lines.
+With MultiPV, stockfish prints one line per legal move (numbered by "multipv") at the end of each depth, so a line with multipv equal to the number of legal moves ends a depth, and we compare the buckets at that point with those at the previous depth.
+After the first few seconds of a search it also prints all of the lines in between, but then the moves it hasn't searched yet at the new depth are shown at the previous depth, so a last line with a new depth still means all of them are done.
 
-First we parse the line and get the first move, in the example above this is g8f6.
-We then look in the evals already stored on the move, and see if this is already present.
-If it is, we update the cp eval, since the later lines from stockfish override the earlier ones.
-If it is not, then we must add it, and also increment the number of move evals.
+We stop the search by sending "stop", and then still wait for "bestmove" as usual, so all the output of the search is before the next highwater mark.
+AdaptiveSearch is the state for one search, with parsed our position in the engine's output; we keep one per stockfish process in do_analysis_pool.
+*/
 
-Before we start, we can allocate the move eval structs, probably 128 is a safe number as we're unlikely to find more legal moves than that in any game.
-However, if we do, we should detect it, report it (using prt followed by flush) and then crash.
+typedef enum { WINNING, DRAWN, LOSING } position_evaluation;
+position_evaluation evaluate_position(int cp_eval);
+int parse_cp_eval(span line);
+span find_pv_move(span line);
 
-We declare helper functions for any part of the process that seems potentially involved.
-We will have a helper function update_or_add_eval taking a move*, a span for the lan move, and the cp_eval as an int.
+int adaptive_depths = 0; // 0 means a fixed analysis_time_ms for every position
+int min_analysis_time_ms = 100;
+
+typedef struct {
+  Move legal[MAX_MOVES];
+  int n_legal;
+  u8 bucket[MAX_MOVES];      // the latest bucket of each legal move
+  u8 last_bucket[MAX_MOVES]; // the buckets at the end of the last complete depth
+  int last_depth;            // the last complete depth, 0 if none yet
+  int stable_depths;         // complete depths in a row with the same buckets
+  u8 *parsed;                // how far we have read the output of this search
+  long long start_ms;
+  int stopped;               // whether we have sent "stop"
+  u8 slot[MOVE_CODES];       // 1 + the index of each move in legal, 0 for other moves
+} AdaptiveSearch;
+
+/* info_int returns the number after the key (e.g. " depth ") in an info line, or -1 if the key isn't there. */
+
+int info_int(span line, span key) {
+  span at = spanspan(line, key);
+  if (empty(at)) return -1;
+  consume_prefix(&at, key);
+  return atoi((char *)at.buf);
+}
+
+/*
+adaptive_start must be called after set_stockfish_highwater and before the "go" command is sent.
+When the search is restricted with searchmoves, stockfish only prints lines for those moves, so they are the ones we watch.
 */
 
-void update_or_add_eval(move *m, span lan_move, int cp_eval);
+void adaptive_start(AdaptiveSearch *as, StockfishProcess *sp, move *m) {
+  as->n_legal = gen_legal_moves(&m->board, as->legal);
+  if (m->searchmoves.n) {
+    as->n_legal = m->searchmoves.n;
+    for (int i = 0; i < m->searchmoves.n; i++) as->legal[i] = move_from_lan(m->searchmoves.s[i]);
+  }
+  memset(as->slot, 0, sizeof as->slot);
+  for (int i = 0; i < as->n_legal; i++) as->slot[as->legal[i]] = i + 1;
+  memset(as->bucket, DRAWN, sizeof as->bucket);
+  as->last_depth = 0;
+  as->stable_depths = 0;
+  as->parsed = sp->highwater;
+  as->start_ms = now_ms();
+  as->stopped = 0;
+}
 
-void parse_stockfish_output(span output, move *m) {
-  char *line = output.buf;
-  char *end = output.end;
+/* adaptive_read reads the complete lines that are new since the last call and returns 1 if the buckets have converged. */
 
-  // Prepare for parsing
-  m->evals = (MoveEvaluation *)malloc(128 * sizeof(MoveEvaluation));
-  if (!m->evals) {
-    printf("Memory allocation failed\n");
-    exit(EXIT_FAILURE); // Fail loudly on allocation failure
+int adaptive_read(AdaptiveSearch *as, StockfishProcess *sp) {
+  long long start = now_us();
+  u8 *end = sp->output.end;
+  while (end > as->parsed && end[-1] != '\n') end--; // only complete lines
+  span output = {as->parsed, end};
+  as->parsed = end;
+  while (!empty(output)) {
+    span line = next_line(&output);
+    if (!consume_prefix(&line, S("info"))) continue;
+    InfoLine info;
+    parse_info_line(line, &info);
+    if (info.cp == INT_MIN || empty(info.pv_move)) continue;
+    int i = as->slot[move_from_lan(info.pv_move)] - 1;
+    if (i < 0) continue; // a stray line from the previous search
+    as->bucket[i] = evaluate_position(info.cp);
+    int depth = info.depth;
+    if (info.multipv != as->n_legal || depth <= as->last_depth) continue;
+    // This line completes a depth
+    int same = as->last_depth && !memcmp(as->bucket, as->last_bucket, as->n_legal);
+    as->stable_depths = same ? as->stable_depths + 1 : 1;
+    memcpy(as->last_bucket, as->bucket, as->n_legal);
+    as->last_depth = depth;
   }
-  m->n_evals = 0;
+  engine_parse_us += now_us() - start;
+  return as->stable_depths >= adaptive_depths;
+}
 
-  while (line < end) {
-    char *line_end = strchr(line, '\n');
-    if (!line_end) break; /* *** manual fixup *** */
-    //if (!line_end) line_end = end;
+/*
+adaptive_poll reads any new output, and sends "stop" if the buckets have converged and the minimum time has passed.
+It returns the number of milliseconds until we should call it again even if there is no new output (when the buckets have converged before the minimum time), or -1 if only new output can change anything.
+*/
 
-    if (strncmp(line, "info", 4) == 0) {
-      char *score_ptr = strstr(line, " score ");
-      int cp_eval = 0;
-      if (score_ptr && score_ptr < line_end) {
-        /* *** score_type is a manual fixup *** */
-        char *score_type = strstr(score_ptr, "cp ");
-        if (score_type && score_type < line_end) {
-          cp_eval = atoi(score_ptr + strlen(" score cp "));
-        } else if ((score_type = strstr(score_ptr, "mate ")) && score_type < line_end) {
-          // Treat checkmate as large positive or negative value
-          int mate_in = atoi(score_ptr + strlen(" score mate "));
-          cp_eval = mate_in > 0 ? 10000 : -10000; // Simplified representation for mate
-        } else {
+int adaptive_poll(AdaptiveSearch *as, StockfishProcess *sp) {
+  if (!adaptive_read(as, sp) || as->stopped) return -1;
+  long long wait = as->start_ms + min_analysis_time_ms - now_ms();
+  if (wait > 0) return wait;
+  send_to_stockfish(sp, "stop\n");
+  as->stopped = 1;
+  return -1;
+}
+
+/* wait_for_adaptive_search is poll_stockfish(S("bestmove"), max_wait_ms, sp) with adaptive_poll added, for analyze_move_2. */
+
+void wait_for_adaptive_search(AdaptiveSearch *as, StockfishProcess *sp, int max_wait_ms) {
+  long long deadline = now_ms() + max_wait_ms;
+  while (!stockfish_new_output_contains(sp, S("bestmove"))) {
+    long long wake = adaptive_poll(as, sp);
+    long long remaining = deadline - now_ms();
+    if (remaining <= 0) {
+      prt("Warning: Max wait time of %d ms exceeded while waiting for \"bestmove\".\n", max_wait_ms);
+      flush();
+      exit(EXIT_FAILURE);
+    }
+    if (wake >= 0 && wake < remaining) remaining = wake;
+    if (wait_for_stockfish(sp, remaining)) read_from_stockfish(sp);
+  }
+}
+
+/*
+Two-tier search
+
+With MultiPV set to more than the number of legal moves, stockfish spreads its time over every legal move, and most of them are obviously bad, so their arrows are never in doubt.
+With --two-tier <D> (two_tier_depth) we instead first search every position to depth D only, which is quick, and then look at those shallow evals.
+The moves that matter are the best move (which decides whether the position is winning, drawn, or losing) and the moves whose evals are within TWO_TIER_WINDOW_CP of one of the thresholds of evaluate_position, since those are the ones whose arrows might change with a deeper search.
+In the second pass we search only those moves, for the normal analysis time, with "searchmoves", so stockfish gets much deeper on them than it would on all of the moves.
+Positions where no move is near a threshold don't need the second pass at all.
+
+The evals from the second pass replace the shallow ones for the moves that were searched, and the other moves keep their shallow evals (see parse_stockfish_output_2), so we still have an arrow for every legal move.
+
+go_command makes the "go" command for a move from its analysis_ms, analysis_depth, and searchmoves, and search_max_wait_ms is how long we wait for its "bestmove" before giving up.
+A depth-limited search has no time limit, so for it we are generous.
+*/
+
+int two_tier_depth = 0; // 0 means a single full search per position
+
+#define TWO_TIER_WINDOW_CP 100
+#define DEPTH_SEARCH_MAX_WAIT_MS 60000
+
+void go_command(char *buf, size_t size, move *m) {
+  int n = m->analysis_depth ? snprintf(buf, size, "go depth %d", m->analysis_depth) : snprintf(buf, size, "go movetime %d", m->analysis_ms);
+  if (m->searchmoves.n) n += snprintf(buf + n, size - n, " searchmoves");
+  for (int i = 0; i < m->searchmoves.n && n < (int)size; i++) n += snprintf(buf + n, size - n, " %.*s", len(m->searchmoves.s[i]), m->searchmoves.s[i].buf);
+  if (n < (int)size) snprintf(buf + n, size - n, "\n");
+}
+
+int search_max_wait_ms(move *m) {
+  return m->analysis_depth ? DEPTH_SEARCH_MAX_WAIT_MS : m->analysis_ms + BESTMOVE_GRACE_MS;
+}
+
+int near_threshold(int cp_eval) {
+  return abs(cp_eval - 150) < TWO_TIER_WINDOW_CP || abs(cp_eval + 150) < TWO_TIER_WINDOW_CP;
+}
+
+/* plan_two_tier_second_pass sets redo[i] to -1 and the searchmoves for each position that needs the deep search, and returns how many there are. */
+
+int plan_two_tier_second_pass(Game *game, int *skip, int *redo) {
+  if (!two_tier_depth) return 0;
+  int count = 0;
+  for (int i = 0; i < game->move_count; ++i) {
+    move *m = &game->moves[i];
+    m->analysis_depth = 0;
+    redo[i] = i;
+    if (skip[i] != -1 || !m->n_evals) continue;
+    int best = 0, n_near = 0;
+    for (int j = 0; j < m->n_evals; ++j) {
+      if (m->evals[j].cp_eval > m->evals[best].cp_eval) best = j;
+      if (near_threshold(m->evals[j].cp_eval)) n_near++;
+    }
+    if (!n_near) continue;
+    redo[i] = -1;
+    count++;
+    if (n_near + 1 >= m->n_evals) continue; // nearly every move matters, so search them all
+    m->searchmoves = spans_alloc(n_near + 1);
+    m->searchmoves.n = 0;
+    m->searchmoves.s[m->searchmoves.n++] = m->evals[best].lan_move;
+    for (int j = 0; j < m->n_evals; ++j) {
+      if (j != best && near_threshold(m->evals[j].cp_eval)) m->searchmoves.s[m->searchmoves.n++] = m->evals[j].lan_move;
+    }
+  }
+  return count;
+}
+
+/*
+Game budget
+
+With a flat analysis_time_ms, a 40-ply miniature and a 300-ply endgame take very different amounts of time, and most of the time goes to positions where the arrows were never in doubt.
+With --game-budget <ms> (game_budget_ms) we instead have a total amount of engine time for each game, and spend it in two passes.
+
+In plan_analysis_times, every position that needs analysis gets an equal floor, which together is 1/BUDGET_FLOOR_SHARE of the budget.
+After this first pass, plan_budget_second_pass looks at the evals and gives the rest of the budget (including whatever the first pass didn't use, e.g. with --adaptive) to the positions where more time is most likely to change the arrows.
+Those are the ones where some move's eval is close to a threshold of evaluate_position that would change an arrow, and boundary_margin measures how close.
+Each position within BUDGET_WINDOW_CP of a threshold gets a share in proportion to how much closer it is than that, and is searched again with its share as the movetime, and the evals of the second search replace those of the first.
+(Stockfish still has the first search in its hash table, at least when the same process gets the position again, so the second search is usually well ahead of a fresh one.)
+If no position is close to a threshold, or the shares would be too short to be worth a search, we just finish early, so the budget is an upper bound.
+
+The budget is engine time, so with --engines n the wall time for a game is about budget / n.
+*/
+
+int game_budget_ms = 0; // 0 means no budget, every position gets analysis_time_ms
+
+#define BUDGET_FLOOR_SHARE 2
+#define BUDGET_WINDOW_CP 100
+#define BUDGET_MIN_SEARCH_MS 20
+
+/*
+boundary_margin is how far (in centipawns) the evals on a move are from changing any arrow.
+If the position is winning, the arrows change if a move crosses +150 either way, since that turns it red or green (or turns the whole position into a draw).
+If it is drawn, crossing -150 also turns a move red or green.
+If it is losing, there are no arrows, and only the best move crossing -150 would change that.
+*/
+
+int boundary_margin(move *m) {
+  int best = -10000;
+  for (int i = 0; i < m->n_evals; ++i) if (m->evals[i].cp_eval > best) best = m->evals[i].cp_eval;
+  position_evaluation bpc = evaluate_position(best);
+  if (bpc == LOSING) return abs(best + 150);
+  int margin = INT_MAX;
+  for (int i = 0; i < m->n_evals; ++i) {
+    int cp = m->evals[i].cp_eval;
+    int d = abs(cp - 150);
+    if (bpc == DRAWN && abs(cp + 150) < d) d = abs(cp + 150);
+    if (d < margin) margin = d;
+  }
+  return margin;
+}
+
+void plan_analysis_times(Game *game, int *skip) {
+  int n = 0;
+  for (int i = 0; i < game->move_count; ++i) {
+    game->moves[i].analysis_ms = analysis_time_ms;
+    game->moves[i].analysis_depth = triage_depth ? triage_depth : two_tier_depth;
+    game->moves[i].triage = triage_depth && skip[i] == -1;
+    if (skip[i] == -1) n++;
+  }
+  if (!game_budget_ms || !n) return;
+  int floor_ms = game_budget_ms / BUDGET_FLOOR_SHARE / n;
+  if (floor_ms < 1) floor_ms = 1;
+  for (int i = 0; i < game->move_count; ++i) game->moves[i].analysis_ms = floor_ms;
+}
+
+/* plan_budget_second_pass sets redo[i] to -1 for the positions to search again, and their analysis_ms, and returns how many there are. */
+
+int plan_budget_second_pass(Game *game, int *skip, int *redo) {
+  if (!game_budget_ms) return 0;
+  long long left = game_budget_ms;
+  long long total_weight = 0;
+  for (int i = 0; i < game->move_count; ++i) {
+    redo[i] = i;
+    game->moves[i].searchmoves = (spans){0}; // all of the moves, even after the two-tier pass, so that the evals are replaced
+    if (skip[i] != -1) continue;
+    left -= game->moves[i].searched_ms;
+    int margin = boundary_margin(&game->moves[i]);
+    if (margin < BUDGET_WINDOW_CP) total_weight += BUDGET_WINDOW_CP - margin;
+  }
+  if (left < BUDGET_MIN_SEARCH_MS || !total_weight) return 0;
+  int count = 0;
+  for (int i = 0; i < game->move_count; ++i) {
+    if (skip[i] != -1) continue;
+    int margin = boundary_margin(&game->moves[i]);
+    if (margin >= BUDGET_WINDOW_CP) continue;
+    long long ms = left * (BUDGET_WINDOW_CP - margin) / total_weight;
+    if (ms < BUDGET_MIN_SEARCH_MS) continue;
+    game->moves[i].analysis_ms = ms;
+    redo[i] = -1;
+    count++;
+  }
+  return count;
+}
+
+/*
+Quick check
+
+For a quick look at a large database we don't need an arrow for every legal move, only to know whether the move that was played (m->lan) kept the class (winning, drawn, or losing, see evaluate_position) of the best move.
+With --quick <K> (quick_check) stockfish runs with MultiPV K instead of MULTIPV, so it spends its time on the best few moves instead of spreading it over all of them, and the first pass gives us the best move's eval.
+If the played move is one of the K, we have its eval too.
+Otherwise plan_quick_check_pass asks for one more search of the position with "searchmoves" and just the played move, for the same analysis time, which adds its eval to the others (see parse_stockfish_output_2).
+The output then has a short verdict after each move instead of the arrows (see print_move_verdict).
+
+The evals of a position depend on which move was played there (since that move is always among them), so a position is only shared with an earlier game of a batch if the same move was played from it (see repeat_key), and a position from the cache gets the second search if its evals lack the played move.
+The arrows make no sense without all of the moves, and --adaptive, --two-tier, and --game-budget all decide what to do from the evals of all of the moves, so none of them go with --quick.
+*/
+
+int quick_check = 0;
+int multipv = MULTIPV; // the MultiPV we set on stockfish, K with --quick
+
+MoveEvaluation *played_move_eval(move *m) {
+  Move played = move_from_lan(m->lan);
+  for (int i = 0; i < m->n_evals; ++i) if (move_from_lan(m->evals[i].lan_move) == played) return &m->evals[i];
+  return NULL;
+}
+
+/* plan_quick_check_pass sets redo[i] to -1 and the searchmoves for each position that has no eval for the played move, and returns how many there are. */
+
+int plan_quick_check_pass(Game *game, int *skip, int *redo) {
+  if (!quick_check) return 0;
+  int count = 0;
+  for (int i = 0; i < game->move_count; ++i) {
+    move *m = &game->moves[i];
+    redo[i] = i;
+    if (skip[i] != -1 && skip[i] != i) continue; // takes its evals from an earlier ply
+    if (skip[i] == i && !m->evals) continue; // linked to an earlier game of the batch with the same played move (see batch_link_repeats), whose evals it gets at output
+    if (played_move_eval(m)) continue;
+    m->searchmoves = spans_alloc(1);
+    m->searchmoves.s[0] = m->lan;
+    m->searchmoves.n = 1;
+    redo[i] = -1;
+    count++;
+  }
+  return count;
+}
+
+/*
+Triage
+
+In most positions of a game the class of the position (see evaluate_position) is never in doubt and nothing interesting happens.
+With --triage <depth> (triage_depth) the first pass over the game is a cheap one instead: a search of every position to the given depth with MultiPV 1, which gives us only the eval of the best move.
+plan_triage_full_pass then picks the critical positions, those where the best eval is near one of the thresholds (see near_threshold), or where the eval swings by TRIAGE_SWING_CP or more from one position to the next (as seen from the same side, so that a move that throws away a win shows up as a swing at the position it was played from), and only they get the full analysis of every move, with MultiPV and the analysis time as usual.
+
+The other plies keep their triage flag, and have no arrows in the output, by design rather than for lack of time; so that this can be told apart from a losing position (which has no arrows either), in --triage mode the comment of every fully analyzed position starts with [%bpa full] (see print_move_arrows).
+We don't store triaged positions in the cache.
+The MultiPV is a setting of the stockfish process rather than of a search, so set_search_multipv sends a setoption before each search whose MultiPV differs from the last one.
+Every ply has evals by the time we plan the full pass, since with --batch we don't share positions between the games (see batch_link_repeats): a ply taking its evals from another game only gets them when its game is output, too late for the swing check of the ply before it and for its own.
+The triage pass is a depth-limited search of all of the moves, and the full pass looks at all of them again, so --triage doesn't go with --adaptive, --two-tier, --game-budget, or --quick.
+*/
+
+int triage_depth = 0; // 0 means no triage pass
+
+#define TRIAGE_SWING_CP 100
+
+void set_search_multipv(StockfishProcess *sp, move *m) {
+  int n = m->triage ? 1 : multipv;
+  if (sp->multipv == n) return;
+  char command[64];
+  snprintf(command, sizeof(command), "setoption name MultiPV value %d\n", n);
+  send_to_stockfish(sp, command);
+  sp->multipv = n;
+}
+
+/* triage_best_cp is the best eval we have for the position before ply i (from the triage search or the cache), or INT_MIN if there is no such position. */
+
+int triage_best_cp(Game *game, int i) {
+  if (i >= game->move_count) return INT_MIN;
+  move *m = &game->moves[i];
+  int best = INT_MIN;
+  for (int j = 0; j < m->n_evals; ++j) if (m->evals[j].cp_eval > best) best = m->evals[j].cp_eval;
+  return best;
+}
+
+/* plan_triage_full_pass sets redo[i] to -1 for each critical position, which gets the full search, and returns how many there are. */
+
+int plan_triage_full_pass(Game *game, int *skip, int *redo) {
+  if (!triage_depth) return 0;
+  int count = 0;
+  for (int i = 0; i < game->move_count; ++i) {
+    move *m = &game->moves[i];
+    m->analysis_depth = 0;
+    redo[i] = i;
+    int cp = triage_best_cp(game, i), next = triage_best_cp(game, i + 1);
+    if (skip[i] != -1 || cp == INT_MIN) continue;
+    if (!near_threshold(cp) && (next == INT_MIN || abs(cp + next) < TRIAGE_SWING_CP)) continue;
+    m->triage = 0;
+    redo[i] = -1;
+    count++;
+  }
+  return count;
+}
+
+void analyze_move_2(StockfishProcess *sp, move *m) {
+  // Set highwater mark for Stockfish output to identify new output generated by this command
+  set_stockfish_highwater(sp);
+
+  // Prepare the command string with the analysis time (or depth) for this position
+  char command[4096];
+  go_command(command, sizeof(command), m);
+  set_search_multipv(sp, m);
+
+  AdaptiveSearch as;
+  if (adaptive_depths) adaptive_start(&as, sp, m);
+
+  // Send command to Stockfish to evaluate the position for the specified analysis time
+  long long start = now_ms();
+  send_to_stockfish(sp, command);
+
+  if (adaptive_depths) {
+    // Stop the search early once the buckets of the moves have converged (which always waits for bestmove)
+    wait_for_adaptive_search(&as, sp, search_max_wait_ms(m));
+  } else if (wait_for_bestmove) {
+    // Wait for the end of the search, however long it takes
+    poll_stockfish(S("bestmove"), search_max_wait_ms(m), sp);
+  } else {
+    // Sleep for the specified analysis time to allow Stockfish to evaluate
+    usleep(m->analysis_ms * 1000); // Convert milliseconds to microseconds
+    engine_wait_us += m->analysis_ms * 1000LL;
+
+    // Send "stop" to Stockfish to halt evaluation, in case it's still running
+    send_to_stockfish(sp, "stop\n");
+
+    // Increase the wait time after sending stop to ensure all output is captured
+    //usleep(250 * 1000); // Wait for an additional 250 milliseconds
+
+    // Read output from Stockfish
+    read_from_stockfish(sp);
+  }
+  m->searched_ms += now_ms() - start;
+  engine_search_ms += now_ms() - start;
+
+  // Get the new output generated by our command
+  span output = get_stockfish_new_output(sp);
+
+  // Parse the Stockfish output to extract move evaluations and update the move structure
+  span_arena_push(); // the legal moves are only needed while we parse
+  spans legal_moves = legal_lan_moves(&m->board); /* *** manual fixup *** (now from our own Board rather than "go perft 1") */
+  parse_stockfish_output_2(output, m, legal_moves);
+  span_arena_pop();
+  progress_tick();
+}
+
+/*
+In do_analysis_pool we analyze the positions of a game with several stockfish processes at once.
+The analysis of each position is independent of the others, since each one starts from a "position" command, so we keep every process busy with some position until all of them are done.
+
+We keep for each process the ply it is working on, or -1 if it is idle.
+In a loop, we first give every idle process the next position that hasn't been handed out yet (skipping the plies that do_analysis doesn't need analyzed, according to same_as): we send the position, set the highwater mark, and send "go movetime".
+Then we wait with poll() until one or more of the busy processes has output for us, and read it.
+Unlike analyze_move_2, we don't sleep and send "stop", but wait for the "bestmove" line which stockfish prints when the movetime is up; at that point all the info lines for the position are in the output past the highwater mark, and we parse them into the evals on the move just as analyze_move_2 does.
+The process is then idle again and gets the next position on the next time around the loop.
+
+If no process produces any output for much longer than the movetime, something is wrong and we report it and exit, as poll_stockfish does.
+
+With --adaptive, each process also has an AdaptiveSearch, and before each poll() we call adaptive_poll for the busy ones, which may stop their searches early.
+
+With N processes, the wall time for a game is then close to ceil(plies / N) times the movetime.
+*/
+
+void do_analysis_pool(Game *game, StockfishProcess *engines, int n_engines, int *same_as) {
+  int *busy_ply = malloc(n_engines * sizeof(int));
+  struct pollfd *fds = malloc(n_engines * sizeof(struct pollfd));
+  AdaptiveSearch *as = malloc(n_engines * sizeof(AdaptiveSearch));
+  long long *started = malloc(n_engines * sizeof(long long));
+  if (!busy_ply || !fds || !as || !started) {
+    prt("Memory allocation failed\n"); flush();
+    exit(EXIT_FAILURE);
+  }
+  for (int e = 0; e < n_engines; ++e) busy_ply[e] = -1;
+
+  int next_ply = 0, done = 0;
+  for (int i = 0; i < game->move_count; ++i) if (same_as[i] != -1) done++;
+  int max_wait_ms = BESTMOVE_GRACE_MS;
+  for (int i = 0; i < game->move_count; ++i) {
+    if (same_as[i] == -1 && search_max_wait_ms(&game->moves[i]) > max_wait_ms) max_wait_ms = search_max_wait_ms(&game->moves[i]);
+  }
+  char command[4096];
+  long long deadline = now_ms() + max_wait_ms; // no output at all for max_wait_ms means something is wrong
+
+  while (done < game->move_count) {
+    // Hand out positions to idle processes
+    for (int e = 0; e < n_engines; ++e) {
+      if (busy_ply[e] != -1) continue;
+      while (next_ply < game->move_count && same_as[next_ply] != -1) next_ply++;
+      if (next_ply == game->move_count) break;
+      send_position(&engines[e], game, next_ply);
+      set_stockfish_highwater(&engines[e]);
+      if (adaptive_depths) adaptive_start(&as[e], &engines[e], &game->moves[next_ply]);
+      go_command(command, sizeof(command), &game->moves[next_ply]);
+      set_search_multipv(&engines[e], &game->moves[next_ply]);
+      started[e] = now_ms();
+      send_to_stockfish(&engines[e], command);
+      busy_ply[e] = next_ply++;
+    }
+
+    // Wait for output from any busy process (or until an adaptive search may be stopped, or it is time for a progress line)
+    int n_fds = 0, timeout = deadline - now_ms();
+    if (timeout < 0) timeout = 0;
+    if (progress && timeout > PROGRESS_INTERVAL_MS) timeout = PROGRESS_INTERVAL_MS;
+    for (int e = 0; e < n_engines; ++e) {
+      fds[e].fd = busy_ply[e] == -1 ? -1 : engines[e].from_stockfish[0]; // poll ignores negative fds
+      fds[e].events = POLLIN;
+      fds[e].revents = 0;
+      if (busy_ply[e] != -1) n_fds++;
+      if (busy_ply[e] != -1 && adaptive_depths) {
+        int wake = adaptive_poll(&as[e], &engines[e]);
+        if (wake >= 0 && wake < timeout) timeout = wake;
+      }
+    }
+    assert(n_fds);
+    long long wait_start = now_us();
+    int ready = poll(fds, n_engines, timeout);
+    engine_wait_us += now_us() - wait_start;
+    progress_tick();
+    if (ready < 0) {
+      perror("poll");
+      exit2(EXIT_FAILURE);
+    }
+    if (ready > 0) deadline = now_ms() + max_wait_ms;
+    if (ready == 0 && now_ms() < deadline) continue; // time for adaptive_poll to stop a search, or for progress_tick
+    if (ready == 0) {
+      prt("Warning: Max wait time of %d ms exceeded while waiting for \"bestmove\".\n", max_wait_ms);
+      flush();
+      exit(EXIT_FAILURE);
+    }
+
+    // Collect the results from the processes that have finished
+    for (int e = 0; e < n_engines; ++e) {
+      if (busy_ply[e] == -1 || !fds[e].revents) continue;
+      read_from_stockfish(&engines[e]);
+      if (!stockfish_new_output_contains(&engines[e], S("bestmove"))) continue;
+      span output = get_stockfish_new_output(&engines[e]);
+      move *m = &game->moves[busy_ply[e]];
+      m->searched_ms += now_ms() - started[e];
+      engine_search_ms += now_ms() - started[e];
+      span_arena_push(); // the legal moves are only needed while we parse
+      parse_stockfish_output_2(output, m, legal_lan_moves(&m->board));
+      span_arena_pop();
+      busy_ply[e] = -1;
+      done++;
+    }
+  }
+
+  free(started);
+  free(as);
+  free(fds);
+  free(busy_ply);
+}
+
+/*
+Batch analysis
+
+Even with several stockfish processes, do_analysis works on one game at a time, so at the end of every game the processes that have finished wait for the slowest one, and a game with fewer positions left to analyze than there are processes leaves the rest idle.
+With a database of many games, that adds up.
+
+With --batch <n>, main reads up to n games at a time, and run_batch analyzes all of their positions with one pool of workers, each of which owns one stockfish process.
+A work item is one search, i.e. a game and a ply, and each worker has its own deque of items.
+At the start we deal out the plies of each game to the workers in contiguous runs, so that each worker has a share of every game, in game order.
+An idle worker takes the item at the front of its own deque, and when that is empty it steals the item at the back of the longest other deque (the game furthest from being output), so no worker is idle while there is a search left to do anywhere, however long the last game is.
+We drive all the processes from one thread with poll(), as do_analysis_pool does, so the deques need no locking, and stealing is just which deque the dispatch loop takes the next item from.
+
+When the last search of a pass over a game is done, we plan the game's next pass, as do_analysis does (plan_two_tier_second_pass, plan_budget_second_pass, plan_quick_check_pass, then plan_triage_full_pass), and put its items at the front of the deques, round robin, so that the game doesn't wait behind all the others.
+When a game has no passes left it is complete, and we output complete games in order, each as soon as the games before it are out, so the output still streams and is the same as without --batch.
+
+A position that is repeated in a later game of the same batch is analyzed only once, as long as the later ply is one we would store in the cache (so not a repetition within its game, see repeats_earlier), and we are not in --triage mode: the later ply takes the evals of the earlier one when its game is output, which is after the earlier game.
+We don't send ucinewgame between games, since each worker goes back and forth between them; this only changes what is in stockfish's hash table, which can already change the results a little between positions of the same game.
+
+At the end of the run, report_batch prints on stderr, for each worker, how many searches it did, how many of them it stole from other workers, and its utilization, the fraction of the time in run_batch that it was searching.
+*/
+
+int batch_games = 0; // 0 means one game at a time (do_analysis)
+
+typedef struct {
+  int game, ply;
+} WorkItem;
+
+typedef struct {
+  WorkItem *items; // a ring of cap items, starting at head
+  int cap, head, n;
+} Deque;
+
+void deque_push_back(Deque *d, WorkItem w) {
+  assert(d->n < d->cap);
+  d->items[(d->head + d->n++) % d->cap] = w;
+}
+
+void deque_push_front(Deque *d, WorkItem w) {
+  assert(d->n < d->cap);
+  d->head = (d->head + d->cap - 1) % d->cap;
+  d->items[d->head] = w;
+  d->n++;
+}
+
+WorkItem deque_pop_front(Deque *d) {
+  WorkItem w = d->items[d->head];
+  d->head = (d->head + 1) % d->cap;
+  d->n--;
+  return w;
+}
+
+WorkItem deque_pop_back(Deque *d) {
+  return d->items[(d->head + --d->n) % d->cap];
+}
+
+typedef struct {
+  int *same_as;  // from find_repeats
+  int *redo;     // the plies of the second pass, if any
+  int *skip;     // same_as or redo, whichever is the current pass
+  int *src_game; // for each ply, the earlier game in the batch it takes its evals from, or -1
+  int *src_ply;
+  int pass;      // 0 for the first pass, 1 for the two-tier pass, 2 for the budget pass, 3 for the quick check pass, 4 for the full pass after --triage, 5 when complete
+  int pending;   // searches of the current pass that are not done yet
+} BatchGame;
+
+// Totals over all batches, for report_batch
+long long *worker_busy_us, *worker_searches, *worker_stolen, batch_wall_us;
+
+int games_output = 0; // for the blank line between games
+
+void produce_output_2(Game *game);
+
+void output_game(Game *game) {
+  if (games_output++) terpri(); // A blank line between games
+  produce_output_2(game);
+}
+
+/*
+batch_link_repeats finds the plies of game g whose position was already in an earlier game of the batch, and makes them take the evals from there.
+The positions are in a hash table of the keys of the plies that will be analyzed, which is open addressing as in the eval cache, with 0 for an empty slot.
+*/
+
+void batch_link_repeats(Game *games, BatchGame *bg, int g, u64 *keys, int *key_game, int *key_ply, size_t cap) {
+  Game *game = &games[g];
+  for (int i = 0; i < game->move_count; ++i) {
+    bg[g].src_game[i] = -1;
+    if (triage_depth) continue; // plan_triage_full_pass needs the evals of every ply
+    if (bg[g].same_as[i] != -1 || !(eval_cache_fd != -1 || i < dedupe_plies) || repeats_earlier(game, i)) continue;
+    u64 key = repeat_key(&game->moves[i]);
+    size_t slot = key & (cap - 1);
+    while (keys[slot] && keys[slot] != key) slot = (slot + 1) & (cap - 1);
+    if (!keys[slot]) {
+      keys[slot] = key;
+      key_game[slot] = g;
+      key_ply[slot] = i;
+    } else if (key_game[slot] != g) {
+      bg[g].same_as[i] = i; // nothing to analyze, as for a cache hit
+      plies_analyzed++;
+      bg[g].src_game[i] = key_game[slot];
+      bg[g].src_ply[i] = key_ply[slot];
+    }
+  }
+}
+
+/* batch_advance plans the next pass of game g with searches to do, if any, and puts its items at the front of the deques. */
+
+void batch_advance(Game *games, BatchGame *bg, int g, Deque *deques, int n_workers) {
+  static int next_worker = 0;
+  Game *game = &games[g];
+  while (bg[g].pass < 5 && !bg[g].pending) {
+    bg[g].pass++;
+    int planned = 0;
+    if (bg[g].pass == 1) planned = plan_two_tier_second_pass(game, bg[g].same_as, bg[g].redo);
+    if (bg[g].pass == 2) planned = plan_budget_second_pass(game, bg[g].same_as, bg[g].redo);
+    if (bg[g].pass == 3) planned = plan_quick_check_pass(game, bg[g].same_as, bg[g].redo);
+    if (bg[g].pass == 4) planned = plan_triage_full_pass(game, bg[g].same_as, bg[g].redo);
+    if (!planned) continue;
+    bg[g].skip = bg[g].redo;
+    for (int i = game->move_count - 1; i >= 0; --i) {
+      if (bg[g].redo[i] != -1) continue;
+      deque_push_front(&deques[next_worker], (WorkItem){g, i});
+      next_worker = (next_worker + 1) % n_workers;
+      bg[g].pending++;
+    }
+  }
+}
+
+void run_batch(Game *games, int n_games, StockfishProcess *engines, int n_workers) {
+  long long batch_start = now_us();
+  BatchGame *bg = calloc(n_games, sizeof(BatchGame));
+  Deque *deques = calloc(n_workers, sizeof(Deque));
+  WorkItem *busy = malloc(n_workers * sizeof(WorkItem)); // game -1 when idle
+  long long *started = malloc(n_workers * sizeof(long long));
+  AdaptiveSearch *as = malloc(n_workers * sizeof(AdaptiveSearch));
+  struct pollfd *fds = malloc(n_workers * sizeof(struct pollfd));
+  int total_plies = 0;
+  for (int g = 0; g < n_games; ++g) total_plies += games[g].move_count;
+  size_t cap = 1;
+  while (cap < 2 * (size_t)total_plies + 2) cap *= 2;
+  u64 *keys = calloc(cap, sizeof(u64));
+  int *key_game = malloc(cap * sizeof(int)), *key_ply = malloc(cap * sizeof(int));
+  if (!bg || !deques || !busy || !started || !as || !fds || !keys || !key_game || !key_ply) {
+    prt("Memory allocation failed\n");
+    exit2(EXIT_FAILURE);
+  }
+  if (!worker_busy_us) {
+    worker_busy_us = calloc(n_workers, sizeof(long long));
+    worker_searches = calloc(n_workers, sizeof(long long));
+    worker_stolen = calloc(n_workers, sizeof(long long));
+  }
+  for (int e = 0; e < n_workers; ++e) {
+    // Every item of every pass can end up in one deque
+    deques[e].cap = 5 * total_plies + 1;
+    deques[e].items = malloc(deques[e].cap * sizeof(WorkItem));
+    if (!deques[e].items) {
+      prt("Memory allocation failed\n");
+      exit2(EXIT_FAILURE);
+    }
+    busy[e].game = -1;
+  }
+
+  // The first pass of every game, dealt out in contiguous runs
+  for (int g = 0; g < n_games; ++g) {
+    Game *game = &games[g];
+    int n = game->move_count;
+    bg[g].same_as = find_repeats(game);
+    bg[g].redo = malloc((n + 1) * sizeof(int));
+    bg[g].src_game = malloc((n + 1) * sizeof(int));
+    bg[g].src_ply = malloc((n + 1) * sizeof(int));
+    if (!bg[g].redo || !bg[g].src_game || !bg[g].src_ply) {
+      prt("Memory allocation failed\n");
+      exit2(EXIT_FAILURE);
+    }
+    batch_link_repeats(games, bg, g, keys, key_game, key_ply, cap);
+    plan_analysis_times(game, bg[g].same_as);
+    bg[g].skip = bg[g].same_as;
+    for (int i = 0; i < n; ++i) bg[g].pending += bg[g].same_as[i] == -1;
+    for (int j = 0, k = 0; j < n; ++j) {
+      int i = reverse_plies ? n - 1 - j : j; // with --reverse, the same runs, each one backwards
+      if (bg[g].same_as[i] != -1) continue;
+      int run = reverse_plies ? bg[g].pending - 1 - k++ : k++;
+      deque_push_back(&deques[(long long)run * n_workers / bg[g].pending], (WorkItem){g, i});
+    }
+    batch_advance(games, bg, g, deques, n_workers);
+  }
+
+  int next_output = 0;
+  char command[4096];
+  for (;;) {
+    // Output the complete games, in order
+    while (next_output < n_games && bg[next_output].pass == 5) {
+      Game *game = &games[next_output];
+      BatchGame *b = &bg[next_output];
+      for (int i = 0; i < game->move_count; ++i) {
+        if (b->src_game[i] != -1) copy_evals(&game->moves[i], &games[b->src_game[i]].moves[b->src_ply[i]]);
+      }
+      finish_analysis(game, b->same_as);
+      phase_end(PHASE_ANALYSIS);
+      output_game(game);
+      phase_end(PHASE_OUTPUT);
+      next_output++;
+    }
+    if (next_output == n_games) break;
+
+    // Give every idle worker an item, from its own deque or stolen from the longest other one
+    for (int e = 0; e < n_workers; ++e) {
+      if (busy[e].game != -1) continue;
+      int from = e;
+      if (!deques[e].n) {
+        for (int v = 0; v < n_workers; ++v) if (deques[v].n > deques[from].n) from = v;
+        if (!deques[from].n) continue;
+        worker_stolen[e]++;
+      }
+      WorkItem w = from == e ? deque_pop_front(&deques[e]) : deque_pop_back(&deques[from]);
+      move *m = &games[w.game].moves[w.ply];
+      send_position(&engines[e], &games[w.game], w.ply);
+      set_stockfish_highwater(&engines[e]);
+      if (adaptive_depths) adaptive_start(&as[e], &engines[e], m);
+      go_command(command, sizeof(command), m);
+      set_search_multipv(&engines[e], m);
+      started[e] = now_ms();
+      send_to_stockfish(&engines[e], command);
+      busy[e] = w;
+    }
+
+    // Wait for output from any busy worker, until the earliest deadline (or until an adaptive search may be stopped)
+    int timeout = INT_MAX, n_busy = 0;
+    long long now = now_ms();
+    for (int e = 0; e < n_workers; ++e) {
+      fds[e].fd = busy[e].game == -1 ? -1 : engines[e].from_stockfish[0]; // poll ignores negative fds
+      fds[e].events = POLLIN;
+      fds[e].revents = 0;
+      if (busy[e].game == -1) continue;
+      n_busy++;
+      move *m = &games[busy[e].game].moves[busy[e].ply];
+      long long left = started[e] + search_max_wait_ms(m) - now;
+      if (left <= 0) {
+        prt("Warning: Max wait time of %d ms exceeded while waiting for \"bestmove\".\n", search_max_wait_ms(m));
+        flush();
+        exit(EXIT_FAILURE);
+      }
+      if (left < timeout) timeout = left;
+      if (adaptive_depths) {
+        int wake = adaptive_poll(&as[e], &engines[e]);
+        if (wake >= 0 && wake < timeout) timeout = wake;
+      }
+    }
+    assert(n_busy); // every search that is not done is in a deque or running
+    if (progress && timeout > PROGRESS_INTERVAL_MS) timeout = PROGRESS_INTERVAL_MS;
+    long long wait_start = now_us();
+    int ready = poll(fds, n_workers, timeout);
+    engine_wait_us += now_us() - wait_start;
+    progress_tick();
+    if (ready < 0) {
+      perror("poll");
+      exit2(EXIT_FAILURE);
+    }
+
+    // Collect the results from the workers that have finished
+    for (int e = 0; e < n_workers; ++e) {
+      if (busy[e].game == -1 || !fds[e].revents) continue;
+      read_from_stockfish(&engines[e]);
+      if (!stockfish_new_output_contains(&engines[e], S("bestmove"))) continue;
+      int g = busy[e].game;
+      move *m = &games[g].moves[busy[e].ply];
+      long long searched = now_ms() - started[e];
+      m->searched_ms += searched;
+      engine_search_ms += searched;
+      worker_busy_us[e] += searched * 1000;
+      worker_searches[e]++;
+      span_arena_push(); // the legal moves are only needed while we parse
+      parse_stockfish_output_2(get_stockfish_new_output(&engines[e]), m, legal_lan_moves(&m->board));
+      span_arena_pop();
+      busy[e].game = -1;
+      if (!--bg[g].pending) batch_advance(games, bg, g, deques, n_workers);
+    }
+  }
+
+  for (int g = 0; g < n_games; ++g) {
+    free(bg[g].redo);
+    free(bg[g].src_game);
+    free(bg[g].src_ply);
+  }
+  for (int e = 0; e < n_workers; ++e) free(deques[e].items);
+  free(key_ply);
+  free(key_game);
+  free(keys);
+  free(fds);
+  free(as);
+  free(started);
+  free(busy);
+  free(deques);
+  free(bg);
+  batch_wall_us += now_us() - batch_start;
+}
+
+void report_batch(int n_workers) {
+  if (!worker_busy_us) return;
+  fprintf(stderr, "%-8s %10s %10s %12s\n", "worker", "searches", "stolen", "utilization");
+  for (int e = 0; e < n_workers; ++e) {
+    fprintf(stderr, "%-8d %10lld %10lld %11.1f%%\n", e, worker_searches[e], worker_stolen[e], batch_wall_us ? 100.0 * worker_busy_us[e] / batch_wall_us : 0.0);
+  }
+}
+
+/*
+In parse_stockfish_output, we are given a span containing the "info" lines like those shown above, e.g.:
+
+info depth 13 seldepth 22 multipv 1 score cp -26 nodes 681621 nps 680260 hashfull 302 tbhits 0 time 1002 pv g8f6 b1c3 e7e6 c1g5 f8e7 e2e3 e8g8 g5h4 f6e4 h4e7 d8e7 d1c2 e4f6 f1d3 d5c4 d3c4
+
+Here is another sample line that indicates a forced checkmate line, in this case, mate in one for the other player if c2a4 is played by this player.
+
+info depth 232 seldepth 3 multipv 3 score mate -1 nodes 754894 nps 5353858 tbhits 0 time 141 pv c2a4 a8a4
+info depth 1 seldepth 2 multipv 2 score mate 6 nodes 1258 nps 629000 tbhits 0 time 2 pv c7b7 b1a1
+
+From the info line we need only the cp eval (e.g. -26 above) or mate and the first LAN move after the pv, which identifies the first move in the line.
+Since we are evaluating every legal move, there will be one of these for each legal move in the position.
+We extract the LAN move into a span, after checking whether it is four or five chars long.
+We optimistically assume that we can locate the LAN move by searching for " pv ".
+
+Sometimes we get a cp eval and sometimes we will get a forced checkmate eval like "score mate -7".
+To handle both cases we can look for " score ", then check whether it is followed by "cp " or "mate ", and then handle the number after that.
+We do not distinguish in our later analysis between mate and extreme centipawn values so we will just replace any mate with a large eval like +10000 or -10000.
+This way we can continue to treat the cp eval as an integer downstream of this parsing function.
+
+The input may contain other lines that do not start with "info", which we must ignore.
+We can make one pass over all the lines.
+
+First we parse the line and get the first move, in the example above this is g8f6.
+We then look in the evals already stored on the move, and see if this is already present.
+If it is, we update the cp eval, since the later lines from stockfish override the earlier ones.
+If it is not, then we must add it, and also increment the number of move evals.
+
+Before we start, we can allocate the move eval structs, probably 128 is a safe number as we're unlikely to find more legal moves than that in any game.
+However, if we do, we should detect it, report it (using prt followed by flush) and then crash.
+
+We declare helper functions for any part of the process that seems potentially involved.
+We will have a helper function update_or_add_eval taking a move*, a span for the lan move, and the cp_eval as an int.
+*/
+
+void update_or_add_eval(move *m, span lan_move, int cp_eval);
+
+void parse_stockfish_output(span output, move *m) {
+  char *line = output.buf;
+  char *end = output.end;
+
+  // Prepare for parsing
+  m->evals = (MoveEvaluation *)malloc(128 * sizeof(MoveEvaluation));
+  if (!m->evals) {
+    printf("Memory allocation failed\n");
+    exit(EXIT_FAILURE); // Fail loudly on allocation failure
+  }
+  m->n_evals = 0;
+
+  while (line < end) {
+    char *line_end = strchr(line, '\n');
+    if (!line_end) break; /* *** manual fixup *** */
+    //if (!line_end) line_end = end;
+
+    if (strncmp(line, "info", 4) == 0) {
+      char *score_ptr = strstr(line, " score ");
+      int cp_eval = 0;
+      if (score_ptr && score_ptr < line_end) {
+        /* *** score_type is a manual fixup *** */
+        char *score_type = strstr(score_ptr, "cp ");
+        if (score_type && score_type < line_end) {
+          cp_eval = atoi(score_ptr + strlen(" score cp "));
+        } else if ((score_type = strstr(score_ptr, "mate ")) && score_type < line_end) {
+          // Treat checkmate as large positive or negative value
+          int mate_in = atoi(score_ptr + strlen(" score mate "));
+          cp_eval = mate_in > 0 ? 10000 : -10000; // Simplified representation for mate
+        } else {
           prt("can't parse score: %.*s\n", line_end - line, line);
           continue;
           //flush();exit(1);
@@ -2134,11 +4257,51 @@ In particular, this will solve the issue that we had in the original code of inc
 
 Here we rewrite parse_stockfish_output function as parse_stockfish_output_2 using spans throughout.
 Additionally, we had a race condition in the above code where we might be getting stockfish output from the previous position, with moves for the other player.
-To handle this, we first call get_legal_lan_moves to get all the legal moves from stockfish in the current position.
+To handle this, we first get all the legal moves in the current position (originally from stockfish with get_legal_lan_moves, now from the Board stored on the move).
 Then after find_pv_move when we have the lan move that we're about to add to the evals, before actually adding it we call another helper function to tell us if this span is one of the spans in the legal_moves.
 If it isn't, we simply skip it, and this solves the issue with incorrectly adding arrows from the previous half-move.
+
+Of all the info lines, only the last one for each move matters, since update_or_add_eval replaces the eval each time, but we used to parse every line from depth 1 up.
+At the end of each depth (and when it stops) stockfish prints a line for every move, numbered multipv 1 to K, where K is the number of moves searched (the legal moves, or the searchmoves, up to MULTIPV), and this block has the latest eval of every move.
+So (with parse_last_depth_only, the default) last_complete_depth first finds the last such block, scanning the lines backwards from the end of the output, and we only parse from there on.
+Lines without a multipv (e.g. currmove lines, or "info string") don't interrupt a block.
+The evals are the same as if we parsed everything, since every move has a line in the block and anything after it is newer still.
+If there is no complete block (e.g. with --fixed-sleep, where we may read only part of the output of the search) we parse all of the output as before.
+The cost is then in proportion to the number of legal moves rather than moves times depths.
+--parse-all-depths turns this off.
+
+For each line we also have to find its move among the legal moves and among the evals so far, which is_legal_move and update_or_add_eval did by comparing it with each of them in turn.
+Instead we now turn the LAN into a Move, and look it up in slot, a table indexed by the Move itself, which tells us in one step whether the move is legal and where its eval is.
+We fill in the entries for the legal moves (and the evals we already have, when we merge a searchmoves search) before we parse, and clear them again after, so the table costs in proportion to the number of legal moves rather than its size.
 */
 
+int parse_last_depth_only = 1;
+
+span prev_line(span *input) {
+  if (!empty(*input) && input->end[-1] == '\n') input->end--;
+  u8 *nl = memrchr(input->buf, '\n', len(*input));
+  span line = { nl ? nl + 1 : input->buf, input->end };
+  input->end = nl ? nl + 1 : input->buf;
+  return line;
+}
+
+span last_complete_depth(span output, int k) {
+  span rest = output;
+  int expect = k; // the multipv of the line before the one we have matched so far
+  while (!empty(rest) && k > 0) {
+    span line = prev_line(&rest);
+    u8 *line_start = line.buf;
+    if (!consume_prefix(&line, S("info"))) continue;
+    InfoLine info;
+    parse_info_line(line, &info);
+    if (info.multipv < 1) continue;
+    if (info.multipv == expect) expect--;
+    else expect = info.multipv == k ? k - 1 : k; // a new candidate for the end of the block, or not part of one
+    if (!expect) return (span){line_start, output.end};
+  }
+  return output;
+}
+
 // Declaration of additional helper functions that might be needed
 int parse_cp_eval(span line);
 span find_pv_move(span line);
@@ -2147,37 +4310,61 @@ span find_pv_move(span line);
 int is_legal_move(span lan_move, spans legal_moves); // Checks if a LAN move is in the legal_moves list
 
 void parse_stockfish_output_2(span output, move *m, spans legal_moves) {
+  long long start = now_us();
+  searches++;
+  plies_analyzed += !m->evals; // the first search of this position (see --progress)
+
+  // Prepare for parsing (the evals from an earlier search of this position, if any, are replaced, unless this search was restricted to some of the moves, in which case we update those)
+  if (!m->evals || !m->searchmoves.n) {
+    free(m->evals);
+    m->evals = (MoveEvaluation *)malloc(128 * sizeof(MoveEvaluation));
+    if (!m->evals) {
+      prt("Memory allocation failed\n");
+      flush();
+      exit(EXIT_FAILURE); // Fail loudly on allocation failure
+    }
+    m->n_evals = 0;
+  }
 
-  // Prepare for parsing
-  m->evals = (MoveEvaluation *)malloc(128 * sizeof(MoveEvaluation));
-  if (!m->evals) {
-    prt("Memory allocation failed\n");
-    flush();
-    exit(EXIT_FAILURE); // Fail loudly on allocation failure
+  if (parse_last_depth_only) {
+    int k = m->searchmoves.n ? m->searchmoves.n : legal_moves.n, pv = m->triage ? 1 : multipv;
+    output = last_complete_depth(output, k < pv ? k : pv);
   }
-  m->n_evals = 0;
+
+  // For each Move, 0 if it isn't legal, 1 if it is legal and has no eval yet, or 2 + its index in m->evals (see MOVE_CODES)
+  static u8 slot[MOVE_CODES];
+  for (int i = 0; i < legal_moves.n; i++) slot[move_from_lan(legal_moves.s[i])] = 1;
+  for (int i = 0; i < m->n_evals; i++) slot[move_from_lan(m->evals[i].lan_move)] = 2 + i;
+  slot[0] = 0;
 
   while (!empty(output)) {
     span line = next_line(&output); // Extract the next line as a span
 
     if (consume_prefix(&line, S("info"))) {
-      int cp_eval = parse_cp_eval(line); // Parse the cp or mate score
-      span lan_move = find_pv_move(line); // Find the first LAN move after "pv"
-
-      // Check if the LAN move is legal before updating or adding eval
-      if (!empty(lan_move) && is_legal_move(lan_move, legal_moves)) {
-        // Update or add eval for the move
-        update_or_add_eval(m, lan_move, cp_eval);
+      info_lines_parsed++;
+      InfoLine info;
+      parse_info_line(line, &info); // The depth, the cp or mate score, and the first LAN move after "pv"
+      if (info.depth > max_depth_reached) max_depth_reached = info.depth;
+
+      // A move that isn't legal here is from the previous position, and is skipped
+      Move mv = move_from_lan(info.pv_move);
+      if (!slot[mv]) continue;
+      if (info.depth > m->depth) m->depth = info.depth;
+      if (slot[mv] == 1) {
+        if (m->n_evals == 128) {
+          prt("Error: Exceeded the maximum number of move evaluations (128).\n");
+          flush();
+          exit(EXIT_FAILURE);
+        }
+        m->evals[m->n_evals].lan_move = move_lan(mv);
+        slot[mv] = 2 + m->n_evals++;
       }
+      m->evals[slot[mv] - 2].cp_eval = info.cp;
     }
   }
+  for (int i = 0; i < legal_moves.n; i++) slot[move_from_lan(legal_moves.s[i])] = 0;
 
-  // Check for excessive legal moves
-  if (m->n_evals > 128) {
-    prt("Error: More than 128 legal moves found, exceeding allocation.\n");
-    flush();
-    exit(EXIT_FAILURE); // Fail loudly if unexpectedly high number of moves
-  }
+  engine_parse_us += now_us() - start;
 }
 
 // Wrapper to check if a LAN move is legal.
@@ -2236,6 +4423,7 @@ int parse_cp_eval(span line) {
 /*
 In find_pv_move we search for and move past " pv ".
 Then we handle a LAN move which will either be 4 or 5 chars and is followed by a space or possibly a newline.
+(A promotion that ended the line used to lose its fifth char, since we only took it if there was another char after it.)
 */
 
 span find_pv_move(span line) {
@@ -2253,8 +4441,8 @@ span find_pv_move(span line) {
   move.buf = pv_section.buf; // Start of the LAN move
   move.end = move.buf + 4; // Assume 4 characters initially
 
-  // Check if the move is actually 5 characters long (4 chars + ' ' or '\n')
-  if (*(move.end) != ' ' && *(move.end) != '\n' && (move.end + 1) < pv_section.end) {
+  // Check if the move is actually 5 characters long (4 chars + ' ' or '\n'), which may also be the last thing in the line
+  if (move.end < pv_section.end && *(move.end) != ' ' && *(move.end) != '\n') {
     move.end += 1; // Include the fifth character
   }
 
@@ -2267,9 +4455,13 @@ Here we get a move and a LAN move as a span, along with the most recent eval fro
 We can do a linear scan over the move evaluations here as N is small.
 We simply check if the move is already in the list, and if it is, we update the cp eval.
 If not we add it and update the number of evals on the move.
+
+The LAN move we are given points into the stockfish output, which is reused for the next search, so we store the span from move_lan for the same move instead, which never changes.
 */
 
 void update_or_add_eval(move *m, span lan_move, int cp_eval) {
+  lan_move = move_lan(move_from_lan(lan_move));
+
   // Linear scan over existing move evaluations
   for (int i = 0; i < m->n_evals; ++i) {
     // Check if the current evaluation matches the LAN move
@@ -2347,9 +4539,9 @@ We do include one newline at the end, though, so that our output ends with a new
 (The _2 version fixes the order of the move arrows and some move number issue.)
 */
 
-typedef enum { WINNING, DRAWN, LOSING } position_evaluation;
-position_evaluation evaluate_position(int cp_eval);
+// position_evaluation and evaluate_position are declared above, with the adaptive analysis time
 void print_move_arrows(move *m);
+void print_move_verdict(move *m);
 
 void produce_output(Game *game) {
   // Iterate over the tags and reproduce them
@@ -2396,8 +4588,8 @@ void produce_output_2(Game *game) {
     move *current_move = &game->moves[i];
     int move_number = (i / 2) + 1;
 
-    // Generate and print arrows based on move evaluations
-    print_move_arrows(current_move);
+    // Generate and print arrows based on move evaluations (with --quick, the verdict on the move played follows it instead, and with --triage only the fully analyzed positions have them)
+    if (!quick_check && !current_move->triage) print_move_arrows(current_move);
 
     if (i % 2 == 0) { // White's move
       prt("%d. ", move_number);
@@ -2407,12 +4599,16 @@ void produce_output_2(Game *game) {
 
     // Output the SAN move
     prt("%.*s ", current_move->san.end - current_move->san.buf, current_move->san.buf);
+    if (quick_check) print_move_verdict(current_move);
 
     // Print a space after each move or half-move
     // actually don't need this I think -- Ed.
     //prt(" ");
   }
 
+  // The result, which separates this game from the next in a PGN database
+  wrs(game->result);
+
   terpri();
   flush(); // Ensure all output is printed
 }
@@ -2458,10 +4654,13 @@ void print_move_arrows(move *m) {
   }
   position_evaluation bpc = evaluate_position(max_cp_eval);
 
-  if (bpc == LOSING) return; /* *** manual fixup *** */
+  if (bpc == LOSING) { /* *** manual fixup *** */
+    if (triage_depth) prt("{ [%%bpa full] }");
+    return;
+  }
 
-  // Start printing the comment containing arrows
-  prt("{ [%%cal ");
+  // Start printing the comment containing arrows (with --triage, marked as the result of a full analysis)
+  prt(triage_depth ? "{ [%%bpa full] [%%cal " : "{ [%%cal ");
 
   for (int i = 0; i < m->n_evals; ++i) {
     position_evaluation move_eval = evaluate_position(m->evals[i].cp_eval);
@@ -2482,25 +4681,46 @@ void print_move_arrows(move *m) {
   prt("] }");
 }
 
+/*
+print_move_verdict is the --quick replacement for print_move_arrows, and says in a comment after the move whether the move played kept the class of the best move, with G (good) if it did.
+If it didn't, we print R and the change of class, e.g. { R W-D } for a move that turns a win into a draw, with W, D, and L for winning, drawn, and losing.
+If stockfish gave us no eval for the move played, which shouldn't happen, we print { ? }.
+*/
+
+char class_letter[] = { [WINNING] = 'W', [DRAWN] = 'D', [LOSING] = 'L' };
+
+void print_move_verdict(move *m) {
+  MoveEvaluation *played = played_move_eval(m);
+  if (!played) {
+    prt("{ ? }");
+    return;
+  }
+  int max_cp_eval = -10000;
+  for (int i = 0; i < m->n_evals; ++i) if (m->evals[i].cp_eval > max_cp_eval) max_cp_eval = m->evals[i].cp_eval;
+  position_evaluation bpc = evaluate_position(max_cp_eval), move_eval = evaluate_position(played->cp_eval);
+  if (move_eval == bpc) prt("{ G }");
+  else prt("{ R %c-%c }", class_letter[bpc], class_letter[move_eval]);
+}
+
 /*
 In print_positions(Game*) we print out each half-move as a number followed by one or three dots, a space, a SAN move, a FEN string, and a newline.
 This is mainly used to fetch FEN strings for any given position in a game for further use with Stockfish.
 
-We assume that populate_lan_moves has been called first, but since the FEN strings aren't stored above, we call get_fen_from_stockfish() for each position.
+We assume that populate_lan_moves has been called first, so each move has the Board before it; we make the move on a copy of that to get the position after it.
+(This used to send each position to stockfish and call get_fen_from_stockfish(), so now --just-print-fen doesn't need stockfish at all.)
 */
 
-void print_positions(Game *game, StockfishProcess *sp);
+void print_positions(Game *game);
 
-void print_positions(Game *game, StockfishProcess *sp) {
+void print_positions(Game *game) {
   char fen[256]; // Buffer to hold FEN string
   
   // Iterate over each move in the game
   for (int i = 0; i < game->move_count; ++i) {
-    // Set the position in Stockfish up to this move
-    send_position(sp, game, i + 1);
-
-    // Get the current position as FEN from Stockfish
-    get_fen_from_stockfish(sp, fen, sizeof(fen));
+    // Get the position after this move as FEN
+    Board after = game->moves[i].board;
+    make_move(&after, move_from_lan(game->moves[i].lan));
+    board_to_fen(&after, fen, sizeof(fen));
 
     // Print move number and dots
     if (i % 2 == 0) { // White's move
@@ -2514,6 +4734,327 @@ void print_positions(Game *game, StockfishProcess *sp) {
   }
 }
 
+/*
+free_game frees everything that we malloc'd for a game, i.e. the tags, the moves, and the evals on each move.
+The spans that point into the span arena (legal moves, candidate squares, startpos comments) are reclaimed separately by span_arena_pop.
+*/
+
+void free_game(Game *game) {
+  for (int i = 0; i < game->move_count; ++i) free(game->moves[i].evals);
+  free(game->moves);
+  free(game->tags);
+  memset(game, 0, sizeof *game);
+}
+
+/*
+Between games we send "ucinewgame" to each stockfish process, so that it doesn't use what it learned about the previous game, followed by "isready", and we wait for "readyok", since stockfish may take a moment to clear its hash table.
+*/
+
+void new_game_stockfish(StockfishProcess *sp) {
+  set_stockfish_highwater(sp);
+  send_to_stockfish(sp, "ucinewgame\n");
+  send_to_stockfish(sp, "isready\n");
+  poll_stockfish(S("readyok"), 60000, sp);
+}
+
+/* Mock engine
+
+bpa --mock-engine is a stand-in for stockfish which speaks just enough UCI for bpa itself: uci, isready, ucinewgame, setoption name MultiPV, position (startpos or fen, with moves), go (depth, movetime, infinite, searchmoves, and perft 1), stop and quit.
+--bench runs the analysis with it, so that we can measure the time bpa itself takes (parsing the PGN and the engine output, and writing the output) without a real search, and on any machine.
+
+It follows the position on our own Board and lists the legal moves with our move generator.
+The evals are made up from the position hash and the move, and go up and down a few centipawns from one depth to the next, so they are the same on every run, but a move near a threshold can change class between depths, which gives --adaptive something to do.
+Each depth takes mock_depth_ms (the latency, set by --mock-depth-ms), and prints one info line per move, up to the MultiPV setting, best first, each with a PV of mock_pv_moves moves (the output volume, set by --mock-pv), in the same format as stockfish.
+The PV after the first move just follows the first legal move in each position, which is as good as any for our purposes.
+The search ends at mock_max_depth, at the limit from the go command, or at "stop", and then we print bestmove.
+*/
+
+int mock_engine = 0;
+int mock_depth_ms = 2;
+int mock_pv_moves = 10;
+#define MOCK_MAX_PV 64
+int mock_max_depth = 60;
+
+/*
+mock_read_line waits up to timeout_ms (forever if it is negative) for a whole line on stdin, and copies it into line without the newline.
+It returns 1 if there was a line, and 0 if the time ran out first.
+At EOF we exit, since this is how bpa closes its engines.
+*/
+
+u8 mock_input[1 << 16];
+int mock_input_n;
+
+int mock_read_line(int timeout_ms, char *line, int size) {
+  for (;;) {
+    u8 *nl = memchr(mock_input, '\n', mock_input_n);
+    if (nl) {
+      int n = nl - mock_input;
+      int copy = n < size - 1 ? n : size - 1;
+      memcpy(line, mock_input, copy);
+      line[copy] = 0;
+      memmove(mock_input, nl + 1, mock_input_n - n - 1);
+      mock_input_n -= n + 1;
+      return 1;
+    }
+    if (mock_input_n == sizeof(mock_input)) {
+      fprintf(stderr, "mock engine: command longer than %zu bytes\n", sizeof(mock_input));
+      exit(EXIT_FAILURE);
+    }
+    struct pollfd pfd = { 0, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready < 0) {
+      perror("poll");
+      exit(EXIT_FAILURE);
+    }
+    if (ready == 0) return 0;
+    ssize_t r = read(0, mock_input + mock_input_n, sizeof(mock_input) - mock_input_n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) exit(0);
+    mock_input_n += r;
+  }
+}
+
+/* mock_wait answers commands until the clock reaches until_ms (or forever if it is negative), and returns 1 if one of them was "stop". */
+
+int mock_wait(long long until_ms) {
+  char line[256];
+  for (;;) {
+    long long timeout = until_ms < 0 ? -1 : until_ms - now_ms();
+    if (until_ms >= 0 && timeout <= 0) return 0;
+    if (!mock_read_line(timeout, line, sizeof(line))) return 0;
+    if (strcmp(line, "stop") == 0) return 1;
+    if (strcmp(line, "quit") == 0) exit(0);
+    if (strcmp(line, "isready") == 0) {
+      prt("readyok\n");
+      flush();
+    }
+  }
+}
+
+int mock_eval(Board *b, Move m, int depth) {
+  u64 state = board_hash(b) ^ ((u64)m << 32 | m);
+  u64 r = splitmix64(&state);
+  return (int)(r % 901) - 450 + ((int)((r >> 32) % 7) - 3) * (depth % 3 - 1);
+}
+
+/* mock_position sets the board from the arguments of a position command. */
+
+void mock_position(Board *b, char *args) {
+  char *moves = strstr(args, "moves");
+  if (strncmp(args, "startpos", 8) == 0) {
+    board_startpos(b);
+  } else if (strncmp(args, "fen ", 4) == 0) {
+    char *fen_end = moves ? moves : args + strlen(args);
+    if (!board_from_fen(b, (span){(u8*)args + 4, (u8*)fen_end})) {
+      fprintf(stderr, "mock engine: bad FEN in position %s\n", args);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (!moves) return;
+  for (char *lan = strtok(moves + 5, " "); lan; lan = strtok(NULL, " ")) {
+    Move m = move_from_lan(S(lan));
+    if (!find_legal_move(b, m)) {
+      fprintf(stderr, "mock engine: illegal move %s in position command\n", lan);
+      exit(EXIT_FAILURE);
+    }
+    make_move(b, m);
+  }
+}
+
+/* mock_pv writes the PV starting with move m (mock_pv_moves long, or less if the game ends) into pv, which must have room for MOCK_MAX_PV moves. */
+
+void mock_pv(Board *b, Move m, char *pv) {
+  Board after = *b;
+  for (int ply = 0; ply < mock_pv_moves && ply < MOCK_MAX_PV; ply++) {
+    span lan = move_lan(m);
+    pv += sprintf(pv, "%s%.*s", ply ? " " : "", len(lan), lan.buf);
+    make_move(&after, m);
+    Move next[MAX_MOVES];
+    if (!gen_legal_moves(&after, next)) break;
+    m = next[0];
+  }
+  *pv = 0;
+}
+
+/* mock_go runs one search, as described above, for the arguments of a go command. */
+
+void mock_go(Board *b, char *args, int multipv) {
+  Move moves[MAX_MOVES];
+  int n = gen_legal_moves(b, moves);
+
+  int depth = 0, movetime = 0, infinite = 0, n_searchmoves = 0, in_searchmoves = 0;
+  Move searchmoves[MAX_MOVES];
+  for (char *tok = strtok(args, " "); tok; tok = strtok(NULL, " ")) {
+    if (strcmp(tok, "perft") == 0) {
+      for (int i = 0; i < n; i++) prt("%.*s: 1\n", len(move_lan(moves[i])), move_lan(moves[i]).buf);
+      prt("\nNodes searched: %d\n\n", n);
+      flush();
+      return;
+    }
+    if (strcmp(tok, "depth") == 0 && (tok = strtok(NULL, " "))) depth = atoi(tok);
+    else if (strcmp(tok, "movetime") == 0 && (tok = strtok(NULL, " "))) movetime = atoi(tok);
+    else if (strcmp(tok, "infinite") == 0) infinite = 1;
+    else if (strcmp(tok, "searchmoves") == 0) in_searchmoves = 1;
+    else if (in_searchmoves && n_searchmoves < MAX_MOVES) searchmoves[n_searchmoves++] = move_from_lan(S(tok));
+  }
+  if (n_searchmoves) {
+    memcpy(moves, searchmoves, n_searchmoves * sizeof(Move));
+    n = n_searchmoves;
+  }
+
+  // The PV of each move, which doesn't change from depth to depth
+  static char pvs[MAX_MOVES][MOCK_MAX_PV * 6 + 1];
+  for (int i = 0; i < n; i++) mock_pv(b, moves[i], pvs[i]);
+
+  long long start = now_ms();
+  Move best = n ? moves[0] : 0;
+  int stopped = 0;
+  for (int d = 1; d <= mock_max_depth && (!depth || d <= depth); d++) {
+    long long until = now_ms() + mock_depth_ms;
+    if (movetime && until > start + movetime) until = start + movetime;
+    if ((stopped = mock_wait(until))) break;
+    if (movetime && now_ms() >= start + movetime) break;
+
+    int cp[MAX_MOVES], order[MAX_MOVES];
+    for (int i = 0; i < n; i++) {
+      cp[i] = mock_eval(b, moves[i], d);
+      int j = i;
+      for (; j > 0 && cp[order[j - 1]] < cp[i]; j--) order[j] = order[j - 1];
+      order[j] = i;
+    }
+    for (int i = 0; i < n && i < multipv; i++) {
+      prt("info depth %d seldepth %d multipv %d score cp %d nodes %d nps %d hashfull 0 tbhits 0 time %lld pv %s\n",
+          d, d + 4, i + 1, cp[order[i]], d * 1000 * n, 1000000, now_ms() - start, pvs[order[i]]);
+    }
+    if (n) best = moves[order[0]];
+    flush();
+  }
+  if (infinite && !stopped) mock_wait(-1);
+  if (best) prt("bestmove %.*s\n", len(move_lan(best)), move_lan(best).buf);
+  else prt("bestmove (none)\n");
+  flush();
+}
+
+void run_mock_engine() {
+  Board b;
+  board_startpos(&b);
+  int multipv = 1;
+  char line[sizeof(mock_input)];
+  for (;;) {
+    mock_read_line(-1, line, sizeof(line));
+    if (strcmp(line, "uci") == 0) prt("id name bpa mock engine\nid author bpa\n\noption name MultiPV type spin default 1 min 1 max 500\nuciok\n");
+    else if (strcmp(line, "isready") == 0) prt("readyok\n");
+    else if (strncmp(line, "setoption name MultiPV value ", 29) == 0) multipv = atoi(line + 29);
+    else if (strncmp(line, "position ", 9) == 0) mock_position(&b, line + 9);
+    else if (strcmp(line, "go") == 0 || strncmp(line, "go ", 3) == 0) mock_go(&b, line + 2, multipv);
+    else if (strcmp(line, "quit") == 0) exit(0);
+    flush();
+  }
+}
+
+/*
+bench_info_parsing is the microbenchmark for parse_info_line (--bench-parse).
+We make up the output of one search as the mock engine would print it, with every legal move in a middlegame position at each of 30 depths, and then parse it many times, once with parse_info_line and once with what we used before it (parse_cp_eval, find_pv_move, and info_int for the depth and multipv), check that they agree, and print the time per line of each on stderr.
+*/
+
+void bench_info_parsing() {
+  Board b;
+  board_from_fen(&b, S("r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP2BPPP/R2QKB1R w KQ - 0 9"));
+  Move moves[MAX_MOVES];
+  int n = gen_legal_moves(&b, moves);
+  static char pv[MOCK_MAX_PV * 6 + 1];
+  size_t cap = 1 << 24;
+  u8 *buf = malloc(cap), *p = buf;
+  for (int d = 1; d <= 30; d++) {
+    for (int i = 0; i < n; i++) {
+      mock_pv(&b, moves[i], pv);
+      p += snprintf((char*)p, cap - (p - buf), "info depth %d seldepth %d multipv %d score %s %d nodes %d nps 1000000 hashfull %d tbhits 0 time %d pv %s\n",
+                    d, d + 6, i + 1, i == n - 1 ? "mate" : "cp", mock_eval(&b, moves[i], d), d * 123457, d * 11, d * 97, pv);
+    }
+  }
+  span output = {buf, p};
+  int lines = 30 * n, reps = 200;
+  long long check = 0;
+
+  // We split the lines first, since that is the same either way
+  span *split = malloc(lines * sizeof(span));
+  for (int i = 0; i < lines; i++) {
+    split[i] = next_line(&output);
+    consume_prefix(&split[i], S("info"));
+  }
+  output.buf = buf;
+
+  long long start = now_us();
+  for (int r = 0; r < reps; r++) {
+    for (int l = 0; l < lines; l++) {
+      span line = split[l];
+      int cp = parse_cp_eval(line), depth = info_int(line, S(" depth ")), multipv = info_int(line, S(" multipv "));
+      span lan = find_pv_move(line);
+      check += cp + depth + multipv + len(lan);
+    }
+  }
+  long long old_us = now_us() - start;
+
+  start = now_us();
+  for (int r = 0; r < reps; r++) {
+    for (int l = 0; l < lines; l++) {
+      span line = split[l];
+      InfoLine info;
+      parse_info_line(line, &info);
+      check -= info.cp + info.depth + info.multipv + len(info.pv_move);
+    }
+  }
+  long long new_us = now_us() - start;
+
+  fprintf(stderr, "%d info lines (%zu bytes), %d times\n", lines, (size_t)len(output), reps);
+  fprintf(stderr, "%-18s %10.1f ns/line\n", "spanspan", old_us * 1000.0 / lines / reps);
+  fprintf(stderr, "%-18s %10.1f ns/line\n", "parse_info_line", new_us * 1000.0 / lines / reps);
+  fprintf(stderr, "%-18s %10.1fx\n", "speedup", new_us ? (double)old_us / new_us : 0.0);
+  if (check) fprintf(stderr, "Error: the two parsers disagree\n");
+  free(split);
+  free(buf);
+}
+
+/*
+bench_report prints (on stderr, like report_memory) the number of games and plies, the plies per second, the time of each phase, the bytes parsed (the PGN input and the engine output), and the average depth of the searches (see --reverse).
+*/
+
+void bench_report(int games, int plies) {
+  long long total = 0;
+  for (int i = 0; i < N_PHASES; i++) total += phase_us[i];
+  fprintf(stderr, "%d games, %d plies in %.3f s, %.1f plies/s\n", games, plies, total / 1e6, total ? plies * 1e6 / total : 0.0);
+  for (int i = 0; i < N_PHASES; i++) fprintf(stderr, "%-18s %10.3f s\n", phase_names[i], phase_us[i] / 1e6);
+  fprintf(stderr, "%-18s %10.3f s\n", "  engine wait", engine_wait_us / 1e6);
+  fprintf(stderr, "%-18s %10.3f s\n", "  processing", (phase_us[PHASE_ANALYSIS] - engine_wait_us) / 1e6);
+  fprintf(stderr, "%-18s %10zu bytes\n", "input", input_size);
+  fprintf(stderr, "%-18s %10lld bytes\n", "engine output", engine_bytes_read);
+  fprintf(stderr, "%-18s %10.2f\n", "average depth", depth_plies ? (double)depth_total / depth_plies : 0.0);
+}
+
+/*
+write_stats writes the timings and counters (see now_us) as one JSON object, to the file named by --stats, or to stderr if the name is "-".
+The times are in microseconds.
+*/
+
+void write_stats(char *path, int games, int plies) {
+  FILE *f = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return;
+  }
+  fprintf(f, "{\"games\": %d, \"plies\": %d, \"input_bytes\": %zu,\n", games, plies, input_size);
+  fprintf(f, " \"phases_us\": {");
+  for (int i = 0; i < N_PHASES; i++) fprintf(f, "%s\"%s\": %lld", i ? ", " : "", phase_names[i], phase_us[i]);
+  fprintf(f, "},\n");
+  fprintf(f, " \"engine_wait_us\": %lld, \"engine_parse_us\": %lld,\n", engine_wait_us, engine_parse_us);
+  fprintf(f, " \"engine_commands\": %lld, \"engine_bytes_read\": %lld, \"info_lines_parsed\": %lld, \"searches\": %lld, \"max_depth\": %d,\n",
+          engine_commands, engine_bytes_read, info_lines_parsed, searches, max_depth_reached);
+  fprintf(f, " \"positions_analyzed\": %lld, \"avg_depth\": %.2f,\n", depth_plies, depth_plies ? (double)depth_total / depth_plies : 0.0);
+  fprintf(f, " \"cache_hits\": %d, \"cache_misses\": %d}\n", eval_cache_hits, eval_cache_misses);
+  if (f != stderr) fclose(f);
+}
+
 /*
 We have a global variable analysis_time_ms, and we want to be able to set this from the command line. Write a few lines here to handle argc and argv and update this variable if a corresponding flag is provided, otherwise we will leave it set to the default (which was already initialized above).
 
@@ -2525,10 +5066,55 @@ This is useful if a PGN doesn't parse correctly.
 
 We also have --help which prints a short usage summary, using prt(), flush(), and exit(0).
 
-For the command-line flags we use "--analysis-time", "--just-print-fen", "--debug-parse", and of course "--help".
+We have n_engines, the number of stockfish processes to analyze with (see do_analysis_pool), which must be at least one.
+
+We have wait_for_bestmove (see analyze_move_2), which is on by default; "--fixed-sleep" turns it off.
+
+For the command-line flags we use "--analysis-time", "--just-print-fen", "--debug-parse", "--engines", "--fixed-sleep", and of course "--help".
+
+Any argument that is not a flag is taken as the PGN file to read (input_path, see read_input); with no such argument we read stdin, as before.
+
+We have adaptive_depths, set by "--adaptive <K>", and min_analysis_time_ms, set by "--min-time <ms>" (see adaptive_read).
+
+We have memory_report, set by "--memory-report", which prints the peak memory use of the run on stderr at the end (see report_memory).
+
+We have game_budget_ms, set by "--game-budget <ms>" (see plan_budget_second_pass), and two_tier_depth, set by "--two-tier <depth>" (see plan_two_tier_second_pass).
+
+We have eval_cache_path, set by "--cache <file>", which turns on the eval cache (see eval_cache_open), and dedupe_plies, set by "--dedupe-plies <n>", for how far into each game we remember positions without one (0 turns this off).
+
+We have "--engine <command>", which sets engine_argv[0] (see launch_stockfish), and bench, set by "--bench", which analyzes with our own mock engine (unless --engine is also given) and prints the time of each phase at the end (see bench_report).
+We have batch_games, set by "--batch <n>", to analyze n games at a time with a work-stealing scheduler over the stockfish processes (see run_batch), which doesn't go with --fixed-sleep.
+
+We have parse_last_depth_only, which "--parse-all-depths" turns off (see last_complete_depth).
+
+We have reverse_plies, set by "--reverse", to analyze each game from the last ply to the first (see do_analysis), which only goes with --engines if --batch is given too.
+
+We have quick_check, set by "--quick <K>", which also sets multipv to K (see plan_quick_check_pass), and which doesn't go with --adaptive, --two-tier, or --game-budget.
+
+We have triage_depth, set by "--triage <depth>", for the single-PV first pass that picks the positions to analyze in full (see plan_triage_full_pass), which doesn't go with --adaptive, --two-tier, --game-budget, or --quick.
+
+We have stats_path, set by "--stats <file>", for the JSON timings and counters (see write_stats), with "-" for stderr.
+
+We have progress, set by "--progress", for a line on stderr every second or so with the plies done, the rate, and an ETA (see progress_tick).
+
+"--bench-parse" runs the info line microbenchmark and exits (see bench_info_parsing).
+
+"--perft <depth> [fen]" counts the move tree of the position (the starting position if no FEN is given) and exits (see perft); the FEN is one argument, so it must be quoted.
+
+"--mock-engine" makes us the mock engine (see run_mock_engine), with "--mock-depth-ms <ms>" and "--mock-pv <n>" for its latency per depth and the length of its PVs; with --bench we pass these on to it.
 */
 
 int just_print_fen = 0;
+int n_engines = 1;
+char *input_path = NULL;
+char *eval_cache_path = NULL;
+int memory_report = 0;
+int bench = 0;
+int bench_parse = 0;
+int run_perft_mode = 0, perft_depth = 0;
+char *perft_fen = NULL;
+int engine_given = 0;
+char *stats_path = NULL;
 
 void parse_command_line_arguments(int argc, char *argv[]) {
   for (int i = 1; i < argc; i++) { // Start from 1 to skip the program name
@@ -2536,22 +5122,163 @@ void parse_command_line_arguments(int argc, char *argv[]) {
       if (i + 1 < argc) { // Make sure there's another argument
         analysis_time_ms = atoi(argv[++i]); // Convert next argument to int and increment i
       }
+    } else if (strcmp(argv[i], "--engines") == 0) {
+      if (i + 1 < argc) {
+        n_engines = atoi(argv[++i]);
+      }
+      if (n_engines < 1) {
+        prt("--engines must be at least 1\n");
+        exit2(1);
+      }
+    } else if (strcmp(argv[i], "--adaptive") == 0) {
+      if (i + 1 < argc) {
+        adaptive_depths = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--game-budget") == 0) {
+      if (i + 1 < argc) {
+        game_budget_ms = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--two-tier") == 0) {
+      if (i + 1 < argc) {
+        two_tier_depth = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--min-time") == 0) {
+      if (i + 1 < argc) {
+        min_analysis_time_ms = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      if (i + 1 < argc) {
+        eval_cache_path = argv[++i];
+      }
+    } else if (strcmp(argv[i], "--dedupe-plies") == 0) {
+      if (i + 1 < argc) {
+        dedupe_plies = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--engine") == 0) {
+      if (i + 1 < argc) {
+        engine_argv[0] = argv[++i];
+        engine_given = 1;
+      }
+    } else if (strcmp(argv[i], "--mock-depth-ms") == 0) {
+      if (i + 1 < argc) {
+        mock_depth_ms = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--mock-pv") == 0) {
+      if (i + 1 < argc) {
+        mock_pv_moves = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      if (i + 1 < argc) {
+        stats_path = argv[++i];
+      }
+    } else if (strcmp(argv[i], "--quick") == 0) {
+      if (i + 1 < argc) {
+        quick_check = 1;
+        multipv = atoi(argv[++i]);
+      }
+      if (quick_check && multipv < 1) {
+        prt("--quick must be at least 1\n");
+        exit2(1);
+      }
+    } else if (strcmp(argv[i], "--triage") == 0) {
+      if (i + 1 < argc) {
+        triage_depth = atoi(argv[++i]);
+      }
+      if (triage_depth < 0) {
+        prt("--triage must not be negative\n");
+        exit2(1);
+      }
+    } else if (strcmp(argv[i], "--reverse") == 0) {
+      reverse_plies = 1;
+    } else if (strcmp(argv[i], "--progress") == 0) {
+      progress = 1;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench = 1;
+    } else if (strcmp(argv[i], "--perft") == 0) {
+      if (i + 1 < argc) {
+        perft_depth = atoi(argv[++i]);
+      }
+      if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) perft_fen = argv[++i];
+      run_perft_mode = 1;
+    } else if (strcmp(argv[i], "--bench-parse") == 0) {
+      bench_parse = 1;
+    } else if (strcmp(argv[i], "--mock-engine") == 0) {
+      mock_engine = 1;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      if (i + 1 < argc) {
+        batch_games = atoi(argv[++i]);
+      }
+      if (batch_games < 0) {
+        prt("--batch must not be negative\n");
+        exit2(1);
+      }
+    } else if (strcmp(argv[i], "--parse-all-depths") == 0) {
+      parse_last_depth_only = 0;
+    } else if (strcmp(argv[i], "--fixed-sleep") == 0) {
+      wait_for_bestmove = 0; // Sleep for the movetime and send "stop" instead
     } else if (strcmp(argv[i], "--just-print-fen") == 0) {
       just_print_fen = 1; // Enable just print FEN mode
+    } else if (strcmp(argv[i], "--memory-report") == 0) {
+      memory_report = 1;
     } else if (strcmp(argv[i], "--debug-parse") == 0) {
       debug_mode = 1; // Enable debug mode for parsing
     } else if (strcmp(argv[i], "--help") == 0) {
       // Print usage information
-      prt("Usage: %s [options]\n", argv[0]);
+      prt("Usage: %s [options] [file.pgn]\n", argv[0]);
+      prt("Reads PGN from file.pgn, or from stdin if no file is given.\n");
       prt("Options:\n");
       prt("  --analysis-time <ms>  Set analysis time for Stockfish (in milliseconds)\n");
+      prt("  --adaptive <K>        Stop each search once every move's win/draw/loss class is the same for K depths\n");
+      prt("  --min-time <ms>       With --adaptive, the least time to spend on a position (default 100)\n");
+      prt("  --game-budget <ms>    Spend this much engine time per game, more of it where the arrows are in doubt\n");
+      prt("  --two-tier <depth>    Search all moves to this depth first, then only the moves near a threshold in full\n");
+      prt("  --quick <K>           Search only the best K moves and the move played, and say whether it kept the class of the best\n");
+      prt("  --triage <depth>      Search to this depth with one PV first, and analyze in full only the critical positions\n");
+      prt("  --engines <n>         Analyze with n Stockfish processes in parallel (default 1)\n");
+      prt("  --batch <n>           Analyze n games at a time, keeping every engine busy until the end (see --engines)\n");
+      prt("  --reverse             Analyze each game from the last ply to the first with one engine, to reuse its hash\n");
+      prt("  --cache <file>        Keep evals in file, and reuse them for positions analyzed before with the same settings\n");
+      prt("  --dedupe-plies <n>    Without --cache, reuse evals for positions in the first n plies of every game (default 40)\n");
+      prt("  --engine <command>    Run this UCI engine instead of stockfish\n");
+      prt("  --stats <file>        Write timings and counters as JSON to file (- for stderr) at the end\n");
+      prt("  --progress            Print plies done, plies/s, engine time, and an ETA on stderr every second\n");
+      prt("  --bench               Analyze with the mock engine and print the time of each phase on stderr\n");
+      prt("  --bench-parse         Time the parsing of engine info lines, and exit\n");
+      prt("  --perft <depth> [fen] Count the legal move tree of a position (default the start), and exit\n");
+      prt("  --mock-engine         Act as a mock UCI engine (used by --bench)\n");
+      prt("  --mock-depth-ms <ms>  Time the mock engine takes per depth (default 2)\n");
+      prt("  --mock-pv <n>         Moves in each PV the mock engine prints (default 10)\n");
+      prt("  --parse-all-depths    Parse every info line, not only those from the last complete depth\n");
+      prt("  --fixed-sleep         Sleep for the analysis time and send stop, instead of waiting for bestmove\n");
       prt("  --just-print-fen      Print FEN strings for each move and exit\n");
+      prt("  --memory-report       Print the peak memory use on stderr at the end\n");
       prt("  --debug-parse         Enable debug output for PGN parsing\n");
       prt("  --help                Display this help and exit\n");
       flush();
       exit(0);
+    } else if (strncmp(argv[i], "--", 2) != 0) {
+      input_path = argv[i];
+    } else {
+      prt("Unknown option %s (try --help)\n", argv[i]);
+      exit2(1);
     }
   }
+  if (quick_check && (adaptive_depths || two_tier_depth || game_budget_ms)) {
+    prt("--quick can't be used with --adaptive, --two-tier, or --game-budget\n");
+    exit2(1);
+  }
+  if (batch_games && !wait_for_bestmove) {
+    prt("--batch always waits for bestmove, so it can't be used with --fixed-sleep\n");
+    exit2(1);
+  }
+  if (reverse_plies && n_engines > 1 && !batch_games) {
+    prt("--reverse analyzes with one engine, so --engines needs --batch with it\n");
+    exit2(1);
+  }
+  if (triage_depth && (adaptive_depths || two_tier_depth || game_budget_ms || quick_check)) {
+    prt("--triage can't be used with --adaptive, --two-tier, --game-budget, or --quick\n");
+    exit2(1);
+  }
 }
 
 /*
@@ -2560,6 +5287,68 @@ partly hand-written main() function as also used for debugging, testing partial
 
 #define MAX_SPANS (1 << 20)
 
+/*
+report_memory prints (on stderr, so as not to mix it into the PGN) the peak committed size of every arena, the size of the input, and the peak resident set size of the process as the kernel reports it.
+*/
+
+void report_memory() {
+  size_t total = 0;
+  for (int i = 0; i < n_arenas; i++) {
+    fprintf(stderr, "%-18s %10zu bytes peak (of %zu reserved)\n", arenas[i]->name, arenas[i]->committed, arenas[i]->reserved);
+    total += arenas[i]->committed;
+  }
+  fprintf(stderr, "%-18s %10zu bytes peak\n", "all arenas", total);
+  fprintf(stderr, "%-18s %10zu bytes\n", "input", input_size);
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) fprintf(stderr, "%-18s %10ld KiB\n", "peak resident", ru.ru_maxrss);
+}
+
+/*
+describe_analysis_settings writes into the buffer a string with every setting that affects the evals we get for a position, along with the engine name, which is what we key the eval cache on in addition to the position.
+With --quick the evals are only those of the best K moves and the move played, which must never be taken for a full list, so quick_check is part of the key as well as the MultiPV.
+With --triage we don't store the triaged positions at all, and the critical ones get the usual full search, but after a shallow search of the same position that stockfish's hash table still holds, so triage_depth is part of the key too, and a triage run and a normal one never share evals.
+*/
+
+void describe_analysis_settings(char *buf, size_t size, span engine_name) {
+  snprintf(buf, size, "movetime %d budget %d multipv %d quick %d triage %d two-tier %d adaptive %d min %d engine %.*s",
+           game_budget_ms ? 0 : analysis_time_ms, game_budget_ms, multipv, quick_check, triage_depth, two_tier_depth, adaptive_depths, adaptive_depths ? min_analysis_time_ms : 0, len(engine_name), engine_name.buf);
+}
+
+/*
+Progress
+
+A run over a large database can take hours, and without --progress nothing tells us how far along it is, or whether it has stalled.
+With --progress, progress_tick prints a line like this on stderr, at most once every PROGRESS_INTERVAL_MS:
+
+progress: 1234/5678 plies, 3.1 plies/s, 390.2 engine s, ETA 23m54s
+
+The plies are those analyzed so far (plies_analyzed: the first search of a position, or a repeat or cache hit that needs none) out of all of the plies we know of.
+We only know the plies of the games we have parsed so far (plies_read), so for the rest of the input we assume as many plies per byte as in the part we have parsed.
+The engine seconds are the sum over the stockfish processes of the time they spent searching (engine_search_ms), and the rate is per second of wall time since the start of the analysis (progress_start_ms).
+The ETA is the remaining plies times analysis_time_ms, divided between the engines; it ignores second passes and repeats, so it is only a rough guide.
+If the numbers stop changing while the lines keep coming, stockfish is stuck on a position (and will be given up on after search_max_wait_ms).
+
+Our callers wake up at least every PROGRESS_INTERVAL_MS to call progress_tick (wait_for_stockfish, do_analysis_pool and run_batch shorten their poll timeouts when --progress is on), and the lines go to stderr directly, never into out, so the annotated PGN is the same with or without them.
+*/
+
+int plies_read; // plies in the games parsed so far
+long long progress_start_ms, progress_last_ms;
+
+void progress_tick() {
+  if (!progress) return;
+  long long now = now_ms();
+  if (progress_last_ms && now - progress_last_ms < PROGRESS_INTERVAL_MS) return;
+  progress_last_ms = now;
+
+  long long parsed = inp.buf - input_space, total = inp.end - input_space;
+  long long plies = parsed ? plies_read + (double)plies_read * (total - parsed) / parsed : plies_read;
+  if (plies < plies_analyzed) plies = plies_analyzed;
+  double secs = (now - progress_start_ms) / 1000.0;
+  long long eta_s = (plies - plies_analyzed) * analysis_time_ms / n_engines / 1000;
+  fprintf(stderr, "progress: %lld/%lld plies, %.1f plies/s, %.1f engine s, ETA %lldm%02llds\n",
+          plies_analyzed, plies, secs >= 1 ? plies_analyzed / secs : 0.0, engine_search_ms / 1000.0, eta_s / 60, eta_s % 60);
+}
+
 int main(int argc, char *argv[]) {
 
   init_spans(); // Initialize your spans and buffers
@@ -2567,52 +5356,139 @@ int main(int argc, char *argv[]) {
 
   parse_command_line_arguments(argc, argv);
 
-  read_and_count_stdin(); // Read the PGN data into the inp span
+  if (mock_engine) run_mock_engine(); // never returns
+  if (run_perft_mode) run_perft(perft_depth, perft_fen); // never returns
+  if (bench_parse) {
+    bench_info_parsing();
+    exit(0);
+  }
 
-  Game game = {0};
+  if (bench && !engine_given) {
+    // Run ourselves as the mock engine, with the same mock settings
+    static char depth_ms[16], pv[16];
+    snprintf(depth_ms, sizeof(depth_ms), "%d", mock_depth_ms);
+    snprintf(pv, sizeof(pv), "%d", mock_pv_moves);
+    char *mock_argv[] = { "/proc/self/exe", "--mock-engine", "--mock-depth-ms", depth_ms, "--mock-pv", pv, NULL };
+    memcpy(engine_argv, mock_argv, sizeof(mock_argv));
+  }
+
+  read_input(input_path); // Map or read the PGN data into the inp span
+
+  StockfishProcess *engines = NULL;
+  if (!just_print_fen) {
+    // Rest of the main function, including Stockfish process handling
+    engines = malloc(n_engines * sizeof(StockfishProcess));
+    for (int e = 0; e < n_engines; ++e) {
+      StockfishProcess *sp = &engines[e];
+      launch_stockfish(sp); // Launch and communicate with Stockfish
+
+      // Send command to Stockfish
+      send_to_stockfish(sp, "uci\n");
+      char command[64];
+      snprintf(command, sizeof(command), "setoption name MultiPV value %d\n", multipv);
+      send_to_stockfish(sp, command);
+      sp->multipv = multipv;
+    }
+    if (eval_cache_path) {
+      char settings[512];
+      describe_analysis_settings(settings, sizeof(settings), stockfish_engine_name(&engines[0]));
+      eval_cache_open(eval_cache_path, settings);
+    }
+  }
+
+  /*
+  The input may be a whole PGN database, so we handle one game at a time, and output each annotated game as soon as it is done.
+  We keep the same stockfish processes for all of the games (starting a new game on each of them first), since starting stockfish and loading its network is not free.
+  Everything the game used, both in the span arena and on the heap, is freed before we go on to the next one.
+  */
 
-  parse_pgn(&inp, &game);
+  Game game = {0};
+  int game_count = 0;
+  progress_start_ms = now_ms();
+
+  // With --batch, we read batch_games games at a time and analyze them all together (see run_batch)
+  Game *batch = batch_games && !just_print_fen ? calloc(batch_games, sizeof(Game)) : NULL;
+  int n_batch = 0;
+
+  span_arena_push();
+  phase_mark_us = now_us();
+  while (parse_pgn(&inp, batch ? &batch[n_batch] : &game)) {
+    // Print the moves from the parsed game
+    //print_game(game);
+    phase_end(PHASE_PARSE);
+
+    if (batch) {
+      populate_lan_moves(&batch[n_batch]);
+      phase_end(PHASE_LAN_MOVES);
+      plies_read += batch[n_batch].move_count;
+      game_count++;
+      if (++n_batch < batch_games) continue;
+      run_batch(batch, n_batch, engines, n_engines);
+      for (int g = 0; g < n_batch; ++g) free_game(&batch[g]);
+      n_batch = 0;
+      span_arena_pop();
+      span_arena_push();
+      continue;
+    }
 
-  // Print the moves from the parsed game
-  //print_game(game);
+    populate_lan_moves(&game);
+    phase_end(PHASE_LAN_MOVES);
+    plies_read += game.move_count;
 
-  // Rest of the main function, including Stockfish process handling
-  StockfishProcess sp;
-  launch_stockfish(&sp); // Launch and communicate with Stockfish
-  // Send command to Stockfish, etc.
+    game_count++;
+    if (games_output++) terpri(); // A blank line between games
 
-  // Send command to Stockfish
-  send_to_stockfish(&sp, "uci\n");
-  send_to_stockfish(&sp, "setoption name MultiPV value 500\n");
-  send_to_stockfish(&sp, "ucinewgame\n");
-  
-  populate_lan_moves(&game, &sp);
+    if (just_print_fen) {
+      // just print the FEN strings and moves for easier debugging via manual Stockfish input
+      print_positions(&game);
+      flush();
+      phase_end(PHASE_OUTPUT);
+    } else {
+      // do the normal analysis
+      for (int e = 0; e < n_engines; ++e) new_game_stockfish(&engines[e]);
 
-  if (just_print_fen) {
-    // just print the FEN strings and moves for easier debugging via manual Stockfish input
-    print_positions(&game, &sp);
-  } else {
-    // do the normal analysis
+      //dbgd(game.move_count);
+      //for (int i=0;i < game.move_count;i++) {
+        //wrs(game.moves[i].lan);terpri();
+      //}
 
-    //dbgd(game.move_count);
-    //for (int i=0;i < game.move_count;i++) {
-      //wrs(game.moves[i].lan);terpri();
-    //}
+      // Now we actually do the analysis, for each position reached.
+      do_analysis(&game, engines, n_engines);
+      phase_end(PHASE_ANALYSIS);
 
-    // Now we actually do the analysis, for each position reached.
-    do_analysis(&game, &sp);
+      //print_all_move_evals(&game);
 
-    //print_all_move_evals(&game);
+      produce_output_2(&game);
+      phase_end(PHASE_OUTPUT);
+    }
 
-    produce_output_2(&game);
+    free_game(&game);
+    span_arena_pop();
+    span_arena_push();
+  }
+  phase_end(PHASE_PARSE);
+  if (n_batch) {
+    run_batch(batch, n_batch, engines, n_engines);
+    for (int g = 0; g < n_batch; ++g) free_game(&batch[g]);
+  }
+  free(batch);
+  span_arena_pop();
+
+  // Cleanup for Stockfish processes
+  for (int e = 0; e < n_engines && engines; ++e) {
+    close(engines[e].to_stockfish[1]);
+    close(engines[e].from_stockfish[0]);
+    waitpid(engines[e].pid, NULL, 0); // Wait for Stockfish to exit
   }
-
-  // Cleanup for Stockfish process
-  close(sp.to_stockfish[1]);
-  close(sp.from_stockfish[0]);
-  waitpid(sp.pid, NULL, 0); // Wait for Stockfish to exit
 
   flush(); // Ensure all output is written
+  if (memory_report) report_memory();
+  if (bench) bench_report(game_count, plies_read);
+  if (batch_games) report_batch(n_engines);
+  if (stats_path) write_stats(stats_path, game_count, plies_read);
+
+  for (int e = 0; e < n_engines && engines; ++e) arena_release(&engines[e].output_space);
+  free(engines);
   span_arena_free();
   return 0;
 }
@@ -20,3 +20,31 @@ build() {
 """
 feel free to write function declarations for any helper or library funtions that we need but don't already have.
 """
+
+# Time bpa's own work with the mock engine (see --bench), on sample.pgn and on a larger input made from it.
+# Extra arguments are passed to bpa, e.g. bench --mock-depth-ms 0 --mock-pv 40
+bench() {
+  build || return
+  ./bpa --bench-parse
+  for i in $(seq 20); do cat sample.pgn; echo; done > /tmp/bpa_bench.pgn
+  for f in sample.pgn /tmp/bpa_bench.pgn; do
+    echo "== $f"
+    ./bpa --bench --analysis-time 20 --dedupe-plies 0 "$@" "$f" > /dev/null
+  done
+}
+
+# Check the move generator against the published perft counts of six standard positions (see --perft).
+perft() {
+  build || return
+  while read -r depth nodes fen; do
+    got=$(./bpa --perft "$depth" "$fen" | tail -1 | awk '{print $3}')
+    if [ "$got" = "$nodes" ]; then echo "ok   $nodes  $fen"; else echo "FAIL $got, expected $nodes at depth $depth: $fen"; fi
+  done <<'POSITIONS'
+5 4865609 rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1
+4 4085603 r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1
+5 674624 8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1
+4 422333 r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1
+4 2103487 rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8
+4 3894594 r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10
+POSITIONS
+}